@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "csv.hpp"
+
+static const char csv_index_magic[8] = {'t', 'c', 's', 'v', 'i', 'd', 'x', '2'};
+
+std::vector<std::string> csv_split(const char *s) {
+	std::vector<std::string> ret;
+
+	while (*s && *s != '\n' && *s != '\r') {
+		const char *start = s;
+		int within = 0;
+
+		for (; *s && *s != '\n' && *s != '\r'; s++) {
+			if (*s == '"') {
+				within = !within;
+			}
+
+			if (*s == ',' && !within) {
+				break;
+			}
+		}
+
+		std::string v = std::string(start, s - start);
+		ret.push_back(v);
+
+		if (*s == ',') {
+			s++;
+
+			while (*s && isspace(*s)) {
+				s++;
+			}
+		}
+	}
+
+	return ret;
+}
+
+std::string csv_dequote(std::string s) {
+	std::string out;
+	for (size_t i = 0; i < s.size(); i++) {
+		if (s[i] == '"') {
+			if (i + 1 < s.size() && s[i + 1] == '"') {
+				out.push_back('"');
+			}
+		} else {
+			out.push_back(s[i]);
+		}
+	}
+	return out;
+}
+
+static long long mtime_nsec(struct stat const &st) {
+#ifdef __APPLE__
+	return st.st_mtimespec.tv_nsec;
+#else
+	return st.st_mtim.tv_nsec;
+#endif
+}
+
+static int compare_keys(const char *a, size_t alen, const char *b, size_t blen) {
+	int cmp = memcmp(a, b, alen < blen ? alen : blen);
+	if (cmp != 0) {
+		return cmp;
+	}
+	return (alen > blen) - (alen < blen);
+}
+
+static size_t line_end(const char *csv, size_t len, size_t start) {
+	const char *nl = (const char *) memchr(csv + start, '\n', len - start);
+	if (nl == NULL) {
+		return len;
+	}
+	return nl - csv;
+}
+
+// The same first field that csv_split() would find, without splitting the rest of the line
+static std::string first_field(const char *s, const char *end) {
+	const char *start = s;
+	int within = 0;
+
+	for (; s < end && *s != '\n' && *s != '\r'; s++) {
+		if (*s == '"') {
+			within = !within;
+		}
+
+		if (*s == ',' && !within) {
+			break;
+		}
+	}
+
+	return std::string(start, s - start);
+}
+
+static void build_index(csv_table *t, struct stat const &st, size_t first_line, std::string &out) {
+	std::vector<csv_index_entry> entries;
+	std::string keys;
+
+	// Rows can only be joined by a key named in the header
+	if (t->header.size() > 0) {
+		for (size_t pos = first_line; pos < t->csv_len;) {
+			size_t end = line_end(t->csv, t->csv_len, pos);
+
+			if (t->csv[pos] != '\n' && t->csv[pos] != '\r') {
+				std::string key = csv_dequote(first_field(t->csv + pos, t->csv + end));
+
+				csv_index_entry e;
+				e.key = keys.size();
+				e.line = pos;
+				e.key_len = key.size();
+				e.padding = 0;
+
+				entries.push_back(e);
+				keys.append(key);
+			}
+
+			pos = end + 1;
+		}
+	}
+
+	const char *k = keys.c_str();
+	std::stable_sort(entries.begin(), entries.end(), [k](csv_index_entry const &a, csv_index_entry const &b) {
+		return compare_keys(k + a.key, a.key_len, k + b.key, b.key_len) < 0;
+	});
+
+	// If a key appears more than once, the first row with it is the one that is joined
+	size_t n = 0;
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (n > 0 && compare_keys(k + entries[n - 1].key, entries[n - 1].key_len, k + entries[i].key, entries[i].key_len) == 0) {
+			continue;
+		}
+		entries[n++] = entries[i];
+	}
+	entries.resize(n);
+
+	csv_index_header h;
+	memcpy(h.magic, csv_index_magic, sizeof(h.magic));
+	h.csv_size = st.st_size;
+	h.csv_mtime = st.st_mtime;
+	h.csv_mtime_nsec = mtime_nsec(st);
+	h.count = entries.size();
+	h.keys = sizeof(h) + entries.size() * sizeof(csv_index_entry);
+	h.keys_len = keys.size();
+
+	out.clear();
+	out.append((const char *) &h, sizeof(h));
+	out.append((const char *) entries.data(), entries.size() * sizeof(csv_index_entry));
+	out.append(keys);
+}
+
+// Returns false if the index doesn't belong to this version of the CSV,
+// or if it is damaged in a way that could make lookups read past its end
+static bool use_index(csv_table *t, const char *index, size_t len, struct stat const &st, const char *index_fname) {
+	if (len < sizeof(csv_index_header)) {
+		return false;
+	}
+
+	csv_index_header const *h = (csv_index_header const *) index;
+	if (memcmp(h->magic, csv_index_magic, sizeof(h->magic)) != 0) {
+		return false;
+	}
+	if (h->csv_size != (unsigned long long) st.st_size || h->csv_mtime != (long long) st.st_mtime || h->csv_mtime_nsec != mtime_nsec(st)) {
+		return false;
+	}
+
+	bool ok = h->count <= (len - sizeof(csv_index_header)) / sizeof(csv_index_entry) &&
+		  h->keys == sizeof(csv_index_header) + h->count * sizeof(csv_index_entry) &&
+		  h->keys <= len && h->keys_len == len - h->keys;
+
+	csv_index_entry const *entries = (csv_index_entry const *) (index + sizeof(csv_index_header));
+	for (unsigned long long i = 0; ok && i < h->count; i++) {
+		if (entries[i].key > h->keys_len || entries[i].key_len > h->keys_len - entries[i].key || entries[i].line >= h->csv_size) {
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		fprintf(stderr, "%s: index is damaged; rebuilding it\n", index_fname);
+		return false;
+	}
+
+	t->index = index;
+	t->index_len = len;
+	t->entries = entries;
+	t->count = h->count;
+	t->keys = index + h->keys;
+	return true;
+}
+
+// Maps an existing index file, if there is one that was built from this version of the CSV
+static bool map_index(csv_table *t, const char *index_fname, struct stat const &st) {
+	int fd = open(index_fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat ist;
+	if (fstat(fd, &ist) != 0) {
+		perror(index_fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ist.st_size < (off_t) sizeof(csv_index_header)) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(index_fname);
+		exit(EXIT_FAILURE);
+	}
+	if (close(fd) != 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!use_index(t, (const char *) map, ist.st_size, st, index_fname)) {
+		munmap(map, ist.st_size);
+		return false;
+	}
+
+	madvise(map, ist.st_size, MADV_RANDOM);
+	t->index_mapped = true;
+	return true;
+}
+
+csv_table *csv_open(const char *fname, const char *index_fname) {
+	csv_table *t = new csv_table;
+
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size > 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror(fname);
+			exit(EXIT_FAILURE);
+		}
+
+		t->csv = (const char *) map;
+		t->csv_len = st.st_size;
+	}
+	if (close(fd) != 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t first_line = 0;
+	if (t->csv_len > 0) {
+		size_t end = line_end(t->csv, t->csv_len, 0);
+		std::string line(t->csv, end);
+
+		t->header = csv_split(line.c_str());
+		for (size_t i = 0; i < t->header.size(); i++) {
+			t->header[i] = csv_dequote(t->header[i]);
+		}
+
+		first_line = end + 1;
+	}
+
+	if (index_fname != NULL && map_index(t, index_fname, st)) {
+		return t;
+	}
+
+	build_index(t, st, first_line, t->index_built);
+
+	if (index_fname != NULL) {
+		// Written beside the old index and then renamed over it, so that another
+		// join can't map a partly written index
+		std::string tmp = std::string(index_fname) + ".XXXXXX";
+		int tmpfd = mkstemp(&tmp[0]);
+		if (tmpfd < 0) {
+			perror(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		// mkstemp() makes the file private, but a rebuilt index should be as readable as a new file
+		mode_t mask = umask(0);
+		umask(mask);
+		if (fchmod(tmpfd, 0666 & ~mask) != 0) {
+			perror(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		FILE *f = fdopen(tmpfd, "wb");
+		if (f == NULL) {
+			perror(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(t->index_built.data(), 1, t->index_built.size(), f) != t->index_built.size()) {
+			perror(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fclose(f) != 0) {
+			perror(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (rename(tmp.c_str(), index_fname) != 0) {
+			perror(index_fname);
+			unlink(tmp.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	use_index(t, t->index_built.data(), t->index_built.size(), st, "CSV index");
+	return t;
+}
+
+bool csv_table::find(std::string const &key, std::vector<std::string> &fields) const {
+	const char *k = keys;
+	csv_index_entry const *e = std::lower_bound(entries, entries + count, key, [k](csv_index_entry const &a, std::string const &b) {
+		return compare_keys(k + a.key, a.key_len, b.c_str(), b.size()) < 0;
+	});
+
+	if (e == entries + count || compare_keys(k + e->key, e->key_len, key.c_str(), key.size()) != 0) {
+		return false;
+	}
+
+	std::string line(csv + e->line, line_end(csv, csv_len, e->line) - e->line);
+	fields = csv_split(line.c_str());
+	fields[0] = csv_dequote(fields[0]);
+	return true;
+}
+
+csv_table::~csv_table() {
+	if (csv != NULL) {
+		munmap((void *) csv, csv_len);
+	}
+	if (index_mapped) {
+		munmap((void *) index, index_len);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef CSV_HPP
+#define CSV_HPP
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+std::vector<std::string> csv_split(const char *s);
+std::string csv_dequote(std::string s);
+
+// The index of a join table is an array of entries sorted by key, followed by
+// the key text. Each entry points to the row's line in the CSV file, which is
+// mapped into memory and only split into fields when its key is looked up.
+// The index can be written to a file so that later joins can map it instead
+// of reading the whole CSV again.
+
+struct csv_index_header {
+	char magic[8];
+	unsigned long long csv_size;  // the CSV that the index was built from
+	long long csv_mtime;
+	long long csv_mtime_nsec;
+	unsigned long long count;     // number of entries
+	unsigned long long keys;      // offset of the key text
+	unsigned long long keys_len;  // length of the key text, which ends the file
+};
+
+struct csv_index_entry {
+	unsigned long long key;   // offset into the key text
+	unsigned long long line;  // offset into the CSV
+	unsigned key_len;
+	unsigned padding;
+};
+
+struct csv_table {
+	std::vector<std::string> header;
+
+	const char *csv = NULL;
+	size_t csv_len = 0;
+
+	// Either mapped from the index file or built in memory
+	const char *index = NULL;
+	size_t index_len = 0;
+	bool index_mapped = false;
+	std::string index_built;
+
+	csv_index_entry const *entries = NULL;
+	unsigned long long count = 0;
+	const char *keys = NULL;
+
+	// Finds the first row whose key is key, returning its fields with the key dequoted
+	bool find(std::string const &key, std::vector<std::string> &fields) const;
+
+	~csv_table();
+};
+
+// Opens a CSV file for joining, using or creating index_fname as its index
+// if it isn't NULL, or else building the index in memory
+csv_table *csv_open(const char *fname, const char *index_fname);
+
+#endif
@@ -8,11 +8,13 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <deque>
 #include <zlib.h>
 #include <math.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
 #include <protozero/pbf_reader.hpp>
 #include "mvt.hpp"
 #include "projection.hpp"
@@ -22,8 +24,9 @@
 int minzoom = 0;
 int maxzoom = 32;
 bool force = false;
+size_t CPUS;
 
-void handle(std::string message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline) {
+void handle(std::string &out, std::string message, int z, unsigned x, unsigned y, int describe, std::set<std::string> const &to_decode, bool pipeline) {
 	mvt_tile tile;
 	bool was_compressed;
 
@@ -38,23 +41,25 @@ void handle(std::string message, int z, unsigned x, unsigned y, int describe, st
 	}
 
 	if (!pipeline) {
-		printf("{ \"type\": \"FeatureCollection\"");
+		out.append("{ \"type\": \"FeatureCollection\"");
 
 		if (describe) {
-			printf(", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
+			char buf[200];
+			snprintf(buf, sizeof(buf), ", \"properties\": { \"zoom\": %d, \"x\": %d, \"y\": %d", z, x, y);
+			out.append(buf);
 			if (!was_compressed) {
-				printf(", \"compressed\": false");
+				out.append(", \"compressed\": false");
 			}
-			printf(" }");
+			out.append(" }");
 
 			if (projection != projections) {
-				printf(", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
-				fprintq(stdout, projection->alias);
-				printf(" } }");
+				out.append(", \"crs\": { \"type\": \"name\", \"properties\": { \"name\": ");
+				sprintq(out, projection->alias);
+				out.append(" } }");
 			}
 		}
 
-		printf(", \"features\": [\n");
+		out.append(", \"features\": [\n");
 	}
 
 	bool first_layer = true;
@@ -68,32 +73,185 @@ void handle(std::string message, int z, unsigned x, unsigned y, int describe, st
 		if (!pipeline) {
 			if (describe) {
 				if (!first_layer) {
-					printf(",\n");
+					out.append(",\n");
 				}
 
-				printf("{ \"type\": \"FeatureCollection\"");
-				printf(", \"properties\": { \"layer\": ");
-				fprintq(stdout, layer.name.c_str());
-				printf(", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
-				printf(" }");
-				printf(", \"features\": [\n");
+				out.append("{ \"type\": \"FeatureCollection\"");
+				out.append(", \"properties\": { \"layer\": ");
+				sprintq(out, layer.name.c_str());
+				char buf[200];
+				snprintf(buf, sizeof(buf), ", \"version\": %d, \"extent\": %lld", layer.version, layer.extent);
+				out.append(buf);
+				out.append(" }");
+				out.append(", \"features\": [\n");
 
 				first_layer = false;
 			}
 		}
 
-		layer_to_geojson(stdout, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
+		layer_to_geojson(out, layer, z, x, y, !pipeline, pipeline, pipeline, 0, 0, 0, !force);
 
 		if (!pipeline) {
 			if (describe) {
-				printf("] }\n");
+				out.append("] }\n");
 			}
 		}
 	}
 
 	if (!pipeline) {
-		printf("] }\n");
+		out.append("] }\n");
+	}
+}
+
+static void write_text(std::string &out) {
+	fwrite(out.data(), 1, out.size(), stdout);
+	out.clear();
+}
+
+struct decode_tile {
+	int z;
+	unsigned x;
+	unsigned y;
+	std::string data;
+
+	decode_tile(int nz, unsigned nx, unsigned ny, std::string &&ndata)
+	    : z(nz), x(nx), y(ny), data(std::move(ndata)) {
+	}
+};
+
+// A run of consecutive tiles from the same zoom level,
+// which one worker decodes and formats into one block of text
+struct decode_task {
+	long long seq = 0;
+	std::vector<decode_tile> tiles;
+	size_t size = 0;
+};
+
+// Tasks are decoded and formatted by the workers in whatever order they finish,
+// and the writer puts their text back into the order the tiles were read in.
+// The reader doesn't queue a task more than `limit` ahead of the one being
+// written, so the tasks and results in memory at once are bounded.
+struct decode_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t task_added;
+	pthread_cond_t result_added;
+	pthread_cond_t result_taken;
+
+	std::deque<decode_task> tasks;
+	bool reading_done;
+	std::map<long long, std::string> results;
+	long long next_write;
+	size_t workers_running;
+	size_t limit;
+
+	std::set<std::string> const *to_decode;
+	bool pipeline;
+};
+
+static void lock(decode_pipeline *p) {
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock(decode_pipeline *p) {
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for(pthread_cond_t *cond, decode_pipeline *p) {
+	if (pthread_cond_wait(cond, &p->lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void *decode_worker(void *v) {
+	decode_pipeline *p = (decode_pipeline *) v;
+
+	lock(p);
+	while (true) {
+		while (p->tasks.size() == 0 && !p->reading_done) {
+			wait_for(&p->task_added, p);
+		}
+		if (p->tasks.size() == 0) {
+			break;
+		}
+
+		decode_task task = std::move(p->tasks.front());
+		p->tasks.pop_front();
+		unlock(p);
+
+		std::string text;
+		for (size_t i = 0; i < task.tiles.size(); i++) {
+			if (!p->pipeline && i != 0) {
+				text.append(",\n");
+			}
+
+			decode_tile &t = task.tiles[i];
+			handle(text, std::move(t.data), t.z, t.x, t.y, 1, *(p->to_decode), p->pipeline);
+		}
+
+		lock(p);
+		p->results.insert(std::pair<long long, std::string>(task.seq, std::move(text)));
+		if (task.seq == p->next_write) {
+			pthread_cond_signal(&p->result_added);
+		}
+	}
+
+	p->workers_running--;
+	if (p->workers_running == 0) {
+		pthread_cond_signal(&p->result_added);
+	}
+	unlock(p);
+
+	return NULL;
+}
+
+void *write_worker(void *v) {
+	decode_pipeline *p = (decode_pipeline *) v;
+
+	lock(p);
+	while (true) {
+		std::map<long long, std::string>::iterator it;
+		while ((it = p->results.find(p->next_write)) == p->results.end() && p->workers_running > 0) {
+			wait_for(&p->result_added, p);
+		}
+		if (it == p->results.end()) {
+			break;
+		}
+
+		std::string text = std::move(it->second);
+		p->results.erase(it);
+		bool first = p->next_write == 0;
+		p->next_write++;
+		pthread_cond_signal(&p->result_taken);
+		unlock(p);
+
+		if (!p->pipeline && !first) {
+			printf(",\n");
+		}
+		write_text(text);
+
+		lock(p);
 	}
+	unlock(p);
+
+	return NULL;
+}
+
+void add_task(decode_pipeline *p, decode_task &task) {
+	lock(p);
+	while (task.seq >= p->next_write + (long long) p->limit) {
+		wait_for(&p->result_taken, p);
+	}
+
+	p->tasks.push_back(std::move(task));
+	pthread_cond_signal(&p->task_added);
+	unlock(p);
 }
 
 void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline) {
@@ -111,7 +269,9 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					if (strcmp(map, "SQLite format 3") != 0) {
 						if (z >= 0) {
 							std::string s = std::string(map, st.st_size);
-							handle(s, z, x, y, 1, to_decode, pipeline);
+							std::string out;
+							handle(out, s, z, x, y, 1, to_decode, pipeline);
+							write_text(out);
 							munmap(map, st.st_size);
 							return;
 						} else {
@@ -182,15 +342,39 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			printf("\n}, \"features\": [\n");
 		}
 
-		within = 0;
-		while (sqlite3_step(stmt) == SQLITE_ROW) {
-			if (!pipeline) {
-				if (within) {
-					printf(",\n");
+		decode_pipeline work;
+		pthread_t pthreads[CPUS];
+		pthread_t writer;
+
+		if (CPUS > 1) {
+			pthread_mutex_init(&work.lock, NULL);
+			pthread_cond_init(&work.task_added, NULL);
+			pthread_cond_init(&work.result_added, NULL);
+			pthread_cond_init(&work.result_taken, NULL);
+			work.reading_done = false;
+			work.next_write = 0;
+			work.workers_running = CPUS;
+			work.limit = 4 * CPUS;
+			work.to_decode = &to_decode;
+			work.pipeline = pipeline;
+
+			for (size_t i = 0; i < CPUS; i++) {
+				if (pthread_create(&pthreads[i], NULL, decode_worker, &work) != 0) {
+					perror("pthread_create");
+					exit(EXIT_FAILURE);
 				}
-				within = 1;
 			}
 
+			if (pthread_create(&writer, NULL, write_worker, &work) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		within = 0;
+		decode_task task;
+		std::string out;
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
 			int len = sqlite3_column_bytes(stmt, 0);
 			int tz = sqlite3_column_int(stmt, 1);
 			int tx = sqlite3_column_int(stmt, 2);
@@ -198,7 +382,61 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			ty = (1LL << tz) - 1 - ty;
 			const char *s = (const char *) sqlite3_column_blob(stmt, 0);
 
-			handle(std::string(s, len), tz, tx, ty, 1, to_decode, pipeline);
+			if (CPUS > 1) {
+				if (task.tiles.size() > 0 && (task.size >= 64 * 1024 || task.tiles[0].z != tz)) {
+					long long seq = task.seq;
+					add_task(&work, task);
+					task = decode_task();
+					task.seq = seq + 1;
+				}
+
+				task.tiles.push_back(decode_tile(tz, tx, ty, std::string(s, len)));
+				task.size += len;
+				continue;
+			}
+
+			if (!pipeline) {
+				if (within) {
+					out.append(",\n");
+				}
+				within = 1;
+			}
+
+			handle(out, std::string(s, len), tz, tx, ty, 1, to_decode, pipeline);
+
+			if (out.size() >= 64 * 1024) {
+				write_text(out);
+			}
+		}
+		write_text(out);
+
+		if (CPUS > 1) {
+			if (task.tiles.size() > 0) {
+				add_task(&work, task);
+			}
+
+			lock(&work);
+			work.reading_done = true;
+			pthread_cond_broadcast(&work.task_added);
+			unlock(&work);
+
+			for (size_t i = 0; i < CPUS; i++) {
+				void *retval;
+
+				if (pthread_join(pthreads[i], &retval) != 0) {
+					perror("pthread_join");
+				}
+			}
+
+			void *retval;
+			if (pthread_join(writer, &retval) != 0) {
+				perror("pthread_join");
+			}
+
+			pthread_mutex_destroy(&work.lock);
+			pthread_cond_destroy(&work.task_added);
+			pthread_cond_destroy(&work.result_added);
+			pthread_cond_destroy(&work.result_taken);
 		}
 
 		if (!pipeline) {
@@ -228,7 +466,9 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					fprintf(stderr, "%s: Warning: using tile %d/%u/%u instead of %d/%u/%u\n", fname, z, x, y, oz, ox, oy);
 				}
 
-				handle(std::string(s, len), z, x, y, 0, to_decode, pipeline);
+				std::string out;
+				handle(out, std::string(s, len), z, x, y, 0, to_decode, pipeline);
+				write_text(out);
 				handled = 1;
 			}
 
@@ -258,6 +498,20 @@ int main(int argc, char **argv) {
 	std::set<std::string> to_decode;
 	bool pipeline = false;
 
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	const char *TIPPECANOE_MAX_THREADS = getenv("TIPPECANOE_MAX_THREADS");
+	if (TIPPECANOE_MAX_THREADS != NULL) {
+		cpus = atoi(TIPPECANOE_MAX_THREADS);
+	}
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	if (cpus > 32767) {
+		cpus = 32767;
+	}
+	CPUS = cpus;
+
 	struct option long_options[] = {
 		{"projection", required_argument, 0, 's'},
 		{"maximum-zoom", required_argument, 0, 'z'},
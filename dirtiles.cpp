@@ -4,6 +4,7 @@
 #include <string>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
@@ -124,3 +125,57 @@ void check_dir(const char *dir, bool rm) {
 		closedir(d1);
 	}
 }
+
+void dir_erase_zooms(const char *outdir, int maxzoom) {
+	DIR *d1 = opendir(outdir);
+	if (d1 == NULL) {
+		return;
+	}
+
+	struct dirent *dp;
+	while ((dp = readdir(d1)) != NULL) {
+		if (!numeric(dp->d_name) || atoi(dp->d_name) <= maxzoom) {
+			continue;
+		}
+
+		std::string z = std::string(outdir) + "/" + dp->d_name;
+		DIR *d2 = opendir(z.c_str());
+		if (d2 == NULL) {
+			perror(z.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		struct dirent *dp2;
+		while ((dp2 = readdir(d2)) != NULL) {
+			if (!numeric(dp2->d_name)) {
+				continue;
+			}
+
+			std::string x = z + "/" + dp2->d_name;
+			DIR *d3 = opendir(x.c_str());
+			if (d3 == NULL) {
+				perror(x.c_str());
+				exit(EXIT_FAILURE);
+			}
+
+			struct dirent *dp3;
+			while ((dp3 = readdir(d3)) != NULL) {
+				if (pbfname(dp3->d_name)) {
+					std::string y = x + "/" + dp3->d_name;
+					if (unlink(y.c_str()) != 0) {
+						perror(y.c_str());
+						exit(EXIT_FAILURE);
+					}
+				}
+			}
+
+			closedir(d3);
+			rmdir(x.c_str());
+		}
+
+		closedir(d2);
+		rmdir(z.c_str());
+	}
+
+	closedir(d1);
+}
@@ -9,4 +9,7 @@ void dir_write_tile(const char *outdir, int z, int tx, int ty, std::string const
 
 void check_dir(const char *d, bool rm);
 
+// Removes the tiles of zoom levels deeper than maxzoom
+void dir_erase_zooms(const char *outdir, int maxzoom);
+
 #endif
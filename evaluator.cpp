@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+
+extern "C" {
+#include "jsonpull/jsonpull.h"
+}
+
+#include "evaluator.hpp"
+#include "geometry.hpp"
+#include "mvt.hpp"
+
+static void filter_error(const char *where, const char *message, json_object *j) {
+	char *s = json_stringify(j);
+	fprintf(stderr, "%s: %s: %s\n", where, message, s);
+	free(s);
+	exit(EXIT_FAILURE);
+}
+
+static filter_value compile_value(json_object *j, const char *where) {
+	filter_value v;
+
+	if (j->type == JSON_STRING) {
+		v.type = mvt_string;
+		v.string = j->string;
+	} else if (j->type == JSON_NUMBER) {
+		v.type = mvt_double;
+		v.number = j->number;
+	} else if (j->type == JSON_TRUE || j->type == JSON_FALSE) {
+		v.type = mvt_bool;
+		v.string = (j->type == JSON_TRUE) ? "true" : "false";
+	} else if (j->type == JSON_NULL) {
+		v.type = -1;
+	} else {
+		filter_error(where, "filter value must be a string, number, boolean, or null", j);
+	}
+
+	return v;
+}
+
+static void compile_key(filter_node &f, json_object *j, const char *where) {
+	if (j->type != JSON_STRING) {
+		filter_error(where, "filter key must be a string", j);
+	}
+
+	f.key = j->string;
+	if (f.key == "$type") {
+		f.key_kind = FILTER_KEY_TYPE;
+	} else if (f.key == "$zoom") {
+		f.key_kind = FILTER_KEY_ZOOM;
+	} else if (f.key == "$id") {
+		f.key_kind = FILTER_KEY_ID;
+	} else {
+		f.key_kind = FILTER_KEY_ATTRIBUTE;
+	}
+}
+
+filter_node compile_filter(json_object *j, const char *where) {
+	filter_node f;
+
+	if (j->type == JSON_TRUE) {
+		f.op = FILTER_TRUE;
+		return f;
+	}
+	if (j->type == JSON_FALSE) {
+		f.op = FILTER_FALSE;
+		return f;
+	}
+
+	if (j->type != JSON_ARRAY || j->length < 1 || j->array[0]->type != JSON_STRING) {
+		filter_error(where, "filter must be an array beginning with an operator", j);
+	}
+
+	static const struct {
+		const char *name;
+		filter_op op;
+	} ops[] = {
+		{"all", FILTER_ALL},
+		{"any", FILTER_ANY},
+		{"none", FILTER_NONE},
+		{"has", FILTER_HAS},
+		{"!has", FILTER_NOT_HAS},
+		{"in", FILTER_IN},
+		{"!in", FILTER_NOT_IN},
+		{"==", FILTER_EQ},
+		{"!=", FILTER_NE},
+		{"<", FILTER_LT},
+		{"<=", FILTER_LE},
+		{">", FILTER_GT},
+		{">=", FILTER_GE},
+	};
+
+	const char *name = j->array[0]->string;
+	size_t i;
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (strcmp(name, ops[i].name) == 0) {
+			f.op = ops[i].op;
+			break;
+		}
+	}
+	if (i >= sizeof(ops) / sizeof(ops[0])) {
+		filter_error(where, "unknown filter operator", j);
+	}
+
+	switch (f.op) {
+	case FILTER_ALL:
+	case FILTER_ANY:
+	case FILTER_NONE:
+		for (size_t k = 1; k < j->length; k++) {
+			f.children.push_back(compile_filter(j->array[k], where));
+		}
+		break;
+
+	case FILTER_HAS:
+	case FILTER_NOT_HAS:
+		if (j->length != 2) {
+			filter_error(where, "has and !has take one key", j);
+		}
+		compile_key(f, j->array[1], where);
+		break;
+
+	case FILTER_IN:
+	case FILTER_NOT_IN:
+		if (j->length < 2) {
+			filter_error(where, "in and !in take a key and a list of values", j);
+		}
+		compile_key(f, j->array[1], where);
+		for (size_t k = 2; k < j->length; k++) {
+			f.values.push_back(compile_value(j->array[k], where));
+		}
+		break;
+
+	default:
+		if (j->length != 3) {
+			filter_error(where, "comparison takes one key and one value", j);
+		}
+		compile_key(f, j->array[1], where);
+		f.values.push_back(compile_value(j->array[2], where));
+		break;
+	}
+
+	return f;
+}
+
+feature_filter *parse_feature_filter(const char *json, const char *where) {
+	std::string s = json;
+	json_pull *jp = json_begin_string((char *) s.c_str());
+	json_object *j = json_read_tree(jp);
+
+	if (j == NULL) {
+		fprintf(stderr, "%s: %s\n", where, jp->error != NULL ? jp->error : "no filter");
+		exit(EXIT_FAILURE);
+	}
+	if (j->type != JSON_HASH) {
+		filter_error(where, "filter must be an object whose keys are layer names", j);
+	}
+
+	feature_filter *ff = new feature_filter;
+	for (size_t i = 0; i < j->length; i++) {
+		if (j->keys[i]->type != JSON_STRING) {
+			filter_error(where, "layer name must be a string", j->keys[i]);
+		}
+		ff->layers.insert(std::pair<std::string, filter_node>(j->keys[i]->string, compile_filter(j->values[i], where)));
+	}
+
+	json_free(j);
+	json_end(jp);
+	return ff;
+}
+
+// Zoom rules are evaluated as features are read, before there is any zoom level
+static void check_no_zoom(filter_node const &f, const char *where) {
+	if (f.key_kind == FILTER_KEY_ZOOM) {
+		fprintf(stderr, "%s: zoom rules can't depend on $zoom\n", where);
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < f.children.size(); i++) {
+		check_no_zoom(f.children[i], where);
+	}
+}
+
+static int compile_zoom(json_object *rule, const char *name, const char *where) {
+	json_object *z = json_hash_get(rule, name);
+	if (z == NULL) {
+		return -1;
+	}
+	if (z->type != JSON_NUMBER || z->number < 0) {
+		filter_error(where, "zoom rule minzoom and maxzoom must be non-negative numbers", rule);
+	}
+	return z->number;
+}
+
+feature_zoom_rules *parse_zoom_rules(const char *json, const char *where) {
+	std::string s = json;
+	json_pull *jp = json_begin_string((char *) s.c_str());
+	json_object *j = json_read_tree(jp);
+
+	if (j == NULL) {
+		fprintf(stderr, "%s: %s\n", where, jp->error != NULL ? jp->error : "no zoom rules");
+		exit(EXIT_FAILURE);
+	}
+	if (j->type != JSON_HASH) {
+		filter_error(where, "zoom rules must be an object whose keys are layer names", j);
+	}
+
+	feature_zoom_rules *zr = new feature_zoom_rules;
+	for (size_t i = 0; i < j->length; i++) {
+		if (j->keys[i]->type != JSON_STRING) {
+			filter_error(where, "layer name must be a string", j->keys[i]);
+		}
+		if (j->values[i]->type != JSON_ARRAY) {
+			filter_error(where, "zoom rules for a layer must be an array", j->values[i]);
+		}
+
+		std::vector<zoom_rule> &rules = zr->layers[j->keys[i]->string];
+		for (size_t k = 0; k < j->values[i]->length; k++) {
+			json_object *rule = j->values[i]->array[k];
+			if (rule->type != JSON_HASH) {
+				filter_error(where, "zoom rule must be an object", rule);
+			}
+
+			zoom_rule r;
+			json_object *filter = json_hash_get(rule, "filter");
+			if (filter != NULL) {
+				r.filter = compile_filter(filter, where);
+				check_no_zoom(r.filter, where);
+			}
+			r.minzoom = compile_zoom(rule, "minzoom", where);
+			r.maxzoom = compile_zoom(rule, "maxzoom", where);
+
+			json_object *exclude = json_hash_get(rule, "exclude");
+			if (exclude != NULL) {
+				if (exclude->type != JSON_TRUE && exclude->type != JSON_FALSE) {
+					filter_error(where, "zoom rule exclude must be true or false", rule);
+				}
+				r.exclude = (exclude->type == JSON_TRUE);
+			}
+
+			rules.push_back(r);
+		}
+	}
+
+	json_free(j);
+	json_end(jp);
+	return zr;
+}
+
+// The feature's value for the node's key, as a type and either a string or a number
+struct feature_value {
+	int type;
+	const char *string;
+	double number;
+};
+
+static bool find_value(filter_node const &f, filter_feature const &feature, feature_value &v) {
+	static const char *type_names[] = {"Unknown", "Point", "LineString", "Polygon"};
+
+	switch (f.key_kind) {
+	case FILTER_KEY_TYPE:
+		v.type = mvt_string;
+		v.string = (feature.type >= VT_POINT && feature.type <= VT_POLYGON) ? type_names[feature.type] : type_names[0];
+		return true;
+
+	case FILTER_KEY_ZOOM:
+		v.type = mvt_double;
+		v.number = feature.z;
+		return true;
+
+	case FILTER_KEY_ID:
+		if (!feature.has_id) {
+			return false;
+		}
+		v.type = mvt_double;
+		v.number = feature.id;
+		return true;
+
+	default:
+		if (!feature.lookup(feature.data, f.key.c_str(), &v.type, &v.string)) {
+			return false;
+		}
+		if (v.type == mvt_double) {
+			v.number = atof(v.string);
+		}
+		return true;
+	}
+}
+
+static bool equal(feature_value const &v, filter_value const &c) {
+	if (v.type != c.type) {
+		return false;
+	}
+	if (v.type == -1) {
+		return true;
+	}
+	if (v.type == mvt_double) {
+		return v.number == c.number;
+	}
+	return strcmp(v.string, c.string.c_str()) == 0;
+}
+
+// Returns -1, 0, or 1, or 2 if the values can't be ordered
+static int order(feature_value const &v, filter_value const &c) {
+	if (v.type == mvt_double && c.type == mvt_double) {
+		if (v.number < c.number) {
+			return -1;
+		}
+		if (v.number > c.number) {
+			return 1;
+		}
+		return 0;
+	}
+
+	if (v.type == mvt_string && c.type == mvt_string) {
+		int cmp = strcmp(v.string, c.string.c_str());
+		return (cmp > 0) - (cmp < 0);
+	}
+
+	return 2;
+}
+
+bool evaluate_filter(filter_node const &f, filter_feature const &feature) {
+	switch (f.op) {
+	case FILTER_TRUE:
+		return true;
+
+	case FILTER_FALSE:
+		return false;
+
+	case FILTER_ALL:
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (!evaluate_filter(f.children[i], feature)) {
+				return false;
+			}
+		}
+		return true;
+
+	case FILTER_ANY:
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (evaluate_filter(f.children[i], feature)) {
+				return true;
+			}
+		}
+		return false;
+
+	case FILTER_NONE:
+		for (size_t i = 0; i < f.children.size(); i++) {
+			if (evaluate_filter(f.children[i], feature)) {
+				return false;
+			}
+		}
+		return true;
+
+	default:
+		break;
+	}
+
+	// Null attributes are never stored, so a missing attribute is one that was null
+	feature_value v;
+	bool found = find_value(f, feature, v);
+	if (!found) {
+		v.type = -1;
+	}
+
+	switch (f.op) {
+	case FILTER_HAS:
+		return found;
+
+	case FILTER_NOT_HAS:
+		return !found;
+
+	case FILTER_IN:
+	case FILTER_NOT_IN: {
+		bool in = false;
+		for (size_t i = 0; i < f.values.size(); i++) {
+			if (equal(v, f.values[i])) {
+				in = true;
+				break;
+			}
+		}
+		return in == (f.op == FILTER_IN);
+	}
+
+	case FILTER_EQ:
+		return equal(v, f.values[0]);
+
+	case FILTER_NE:
+		return !equal(v, f.values[0]);
+
+	case FILTER_LT:
+		return order(v, f.values[0]) == -1;
+
+	case FILTER_LE: {
+		int o = order(v, f.values[0]);
+		return o == -1 || o == 0;
+	}
+
+	case FILTER_GT:
+		return order(v, f.values[0]) == 1;
+
+	case FILTER_GE: {
+		int o = order(v, f.values[0]);
+		return o == 1 || o == 0;
+	}
+
+	default:
+		fprintf(stderr, "Internal error: unknown filter operator %d\n", f.op);
+		exit(EXIT_FAILURE);
+	}
+}
+
+bool evaluate_feature_filter(feature_filter const *f, std::string const &layer, filter_feature const &feature) {
+	static const std::string wildcard = "*";
+
+	auto all = f->layers.find(wildcard);
+	if (all != f->layers.end() && !evaluate_filter(all->second, feature)) {
+		return false;
+	}
+
+	auto one = f->layers.find(layer);
+	if (one != f->layers.end() && !evaluate_filter(one->second, feature)) {
+		return false;
+	}
+
+	return true;
+}
+
+static zoom_rule const *first_match(std::vector<zoom_rule> const &rules, filter_feature const &feature) {
+	for (size_t i = 0; i < rules.size(); i++) {
+		if (evaluate_filter(rules[i].filter, feature)) {
+			return &rules[i];
+		}
+	}
+
+	return NULL;
+}
+
+// The first matching rule for the layer itself, or else for "*"
+zoom_rule const *evaluate_zoom_rules(feature_zoom_rules const *r, std::string const &layer, filter_feature const &feature) {
+	static const std::string wildcard = "*";
+
+	auto one = r->layers.find(layer);
+	if (one != r->layers.end()) {
+		zoom_rule const *match = first_match(one->second, feature);
+		if (match != NULL) {
+			return match;
+		}
+	}
+
+	auto all = r->layers.find(wildcard);
+	if (all != r->layers.end()) {
+		return first_match(all->second, feature);
+	}
+
+	return NULL;
+}
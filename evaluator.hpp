@@ -0,0 +1,88 @@
+#ifndef EVALUATOR_HPP
+#define EVALUATOR_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+
+// A feature filter in the style of Mapbox GL filters, compiled once
+// from JSON into a tree that can be evaluated without reparsing.
+
+enum filter_op {
+	FILTER_TRUE,
+	FILTER_FALSE,
+	FILTER_ALL,
+	FILTER_ANY,
+	FILTER_NONE,
+	FILTER_HAS,
+	FILTER_NOT_HAS,
+	FILTER_IN,
+	FILTER_NOT_IN,
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_GT,
+	FILTER_GE,
+};
+
+enum filter_key {
+	FILTER_KEY_ATTRIBUTE,
+	FILTER_KEY_TYPE,
+	FILTER_KEY_ZOOM,
+	FILTER_KEY_ID,
+};
+
+struct filter_value {
+	int type = -1;  // mvt_string, mvt_double, or mvt_bool; -1 for null
+	std::string string;
+	double number = 0;
+};
+
+struct filter_node {
+	filter_op op = FILTER_TRUE;
+	filter_key key_kind = FILTER_KEY_ATTRIBUTE;
+	std::string key;
+	std::vector<filter_value> values;
+	std::vector<filter_node> children;
+};
+
+struct feature_filter {
+	std::map<std::string, filter_node> layers;  // "*" applies to every layer
+};
+
+// Zoom ranges assigned to features by attribute, in place of
+// per-feature "tippecanoe" minzoom and maxzoom in the input
+struct zoom_rule {
+	filter_node filter;
+	int minzoom = -1;  // -1 to leave unset
+	int maxzoom = -1;
+	bool exclude = false;
+};
+
+struct feature_zoom_rules {
+	std::map<std::string, std::vector<zoom_rule>> layers;  // "*" applies to every layer
+};
+
+// Finds the attribute named key, returning its type (mvt_string, mvt_double, mvt_bool)
+// and its stringified value, or false if the feature has no such attribute
+typedef bool (*filter_lookup)(void *data, const char *key, int *type, const char **value);
+
+struct filter_feature {
+	int type;  // VT_POINT, VT_LINE, VT_POLYGON
+	int z;
+	bool has_id;
+	unsigned long long id;
+	filter_lookup lookup;
+	void *data;
+};
+
+feature_filter *parse_feature_filter(const char *json, const char *where);
+filter_node compile_filter(struct json_object *j, const char *where);
+bool evaluate_filter(filter_node const &f, filter_feature const &feature);
+bool evaluate_feature_filter(feature_filter const *f, std::string const &layer, filter_feature const &feature);
+
+feature_zoom_rules *parse_zoom_rules(const char *json, const char *where);
+zoom_rule const *evaluate_zoom_rules(feature_zoom_rules const *r, std::string const &layer, filter_feature const &feature);
+
+#endif
@@ -37,6 +37,7 @@
 #include "text.hpp"
 #include "read_json.hpp"
 #include "mvt.hpp"
+#include "evaluator.hpp"
 
 static long long parse_geometry1(int t, json_object *j, long long *bbox, drawvec &geom, int op, const char *fname, int line, int *initialized, unsigned *initial_x, unsigned *initial_y, json_object *feature, long long &prev, long long &offset, bool &has_prev) {
 	parse_geometry(t, j, geom, op, fname, line, feature);
@@ -95,7 +96,40 @@ static long long parse_geometry1(int t, json_object *j, long long *bbox, drawvec
 	return geom.size();
 }
 
-int serialize_geometry(json_object *geometry, json_object *properties, json_object *id, const char *reading, int line, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, const char *fname, int basezoom, int layer, double droprate, long long *file_bbox, json_object *tippecanoe, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, json_object *feature, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+// A feature's input properties, for the zoom rules
+struct json_properties {
+	json_object *properties;
+	std::string stringified;
+};
+
+static bool lookup_json_property(void *data, const char *key, int *type, const char **value) {
+	json_properties *jp = (json_properties *) data;
+	json_object *v = json_hash_get(jp->properties, key);
+
+	if (v == NULL || v->type == JSON_NULL) {
+		return false;
+	} else if (v->type == JSON_STRING) {
+		*type = mvt_string;
+		*value = v->string;
+	} else if (v->type == JSON_NUMBER) {
+		*type = mvt_double;
+		*value = v->string;
+	} else if (v->type == JSON_TRUE || v->type == JSON_FALSE) {
+		*type = mvt_bool;
+		*value = (v->type == JSON_TRUE) ? "true" : "false";
+	} else {
+		char *s = json_stringify(v);
+		jp->stringified = s;
+		free(s);  // stringify
+
+		*type = mvt_string;
+		*value = jp->stringified.c_str();
+	}
+
+	return true;
+}
+
+int serialize_geometry(json_object *geometry, json_object *properties, json_object *id, const char *reading, int line, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, const char *fname, int basezoom, int layer, double droprate, long long *file_bbox, json_object *tippecanoe, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, json_object *feature, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	json_object *geometry_type = json_hash_get(geometry, "type");
 	if (geometry_type == NULL) {
 		static int warned = 0;
@@ -198,6 +232,35 @@ int serialize_geometry(json_object *geometry, json_object *properties, json_obje
 		}
 	}
 
+	if (zoom_rules != NULL) {
+		json_properties jp;
+		jp.properties = (properties != NULL && properties->type == JSON_HASH) ? properties : NULL;
+
+		filter_feature ff;
+		ff.type = mb_geometry[t];
+		ff.z = 0;
+		ff.has_id = has_id;
+		ff.id = id_value;
+		ff.lookup = lookup_json_property;
+		ff.data = &jp;
+
+		zoom_rule const *rule = evaluate_zoom_rules(zoom_rules, tippecanoe_layername.size() != 0 ? tippecanoe_layername : layername, ff);
+		if (rule != NULL) {
+			// Zooms given explicitly in the feature take precedence over the rule
+			if (tippecanoe_minzoom == -1) {
+				tippecanoe_minzoom = rule->minzoom;
+			}
+			if (tippecanoe_maxzoom == -1) {
+				tippecanoe_maxzoom = rule->maxzoom;
+			}
+
+			// Don't write features that would not appear in any tile
+			if (rule->exclude || tippecanoe_minzoom > maxzoom || (tippecanoe_maxzoom != -1 && tippecanoe_minzoom > tippecanoe_maxzoom)) {
+				return 0;
+			}
+		}
+	}
+
 	long long bbox[] = {LLONG_MAX, LLONG_MAX, LLONG_MIN, LLONG_MIN};
 
 	if (!filters) {
@@ -290,6 +353,15 @@ int serialize_geometry(json_object *geometry, json_object *properties, json_obje
 	if (mb_geometry[t] == VT_POLYGON) {
 		dv = fix_polygon(dv);
 	}
+	if (additional[A_VERTEX_IMPORTANCE] && (mb_geometry[t] == VT_LINE || mb_geometry[t] == VT_POLYGON)) {
+		compute_importance(dv, geometry_scale);
+	}
+
+	// An empty geometry would not appear in any tile, and has no bounding box
+	// to give the feature its index or to add to the bounds of the tileset
+	if (bbox[0] > bbox[2] || bbox[1] > bbox[3] || dv.size() == 0) {
+		return 0;
+	}
 
 	if (want_dist) {
 		std::vector<unsigned long long> locs;
@@ -470,7 +542,7 @@ void check_crs(json_object *j, const char *reading) {
 	}
 }
 
-void parse_json(json_pull *jp, const char *reading, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, char *fname, int basezoom, int layer, double droprate, long long *file_bbox, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void parse_json(json_pull *jp, const char *reading, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, char *fname, int basezoom, int layer, double droprate, long long *file_bbox, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	long long found_hashes = 0;
 	long long found_features = 0;
 	long long found_geometries = 0;
@@ -538,7 +610,7 @@ void parse_json(json_pull *jp, const char *reading, volatile long long *layer_se
 				}
 				found_geometries++;
 
-				serialize_geometry(j, NULL, NULL, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, NULL, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, dist_sum, dist_count, want_dist, filters);
+				serialize_geometry(j, NULL, NULL, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, NULL, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, zoom_rules, dist_sum, dist_count, want_dist, filters);
 				json_free(j);
 				continue;
 			}
@@ -581,10 +653,10 @@ void parse_json(json_pull *jp, const char *reading, volatile long long *layer_se
 		if (geometries != NULL) {
 			size_t g;
 			for (g = 0; g < geometries->length; g++) {
-				serialize_geometry(geometries->array[g], properties, id, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, tippecanoe, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, dist_sum, dist_count, want_dist, filters);
+				serialize_geometry(geometries->array[g], properties, id, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, tippecanoe, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, zoom_rules, dist_sum, dist_count, want_dist, filters);
 			}
 		} else {
-			serialize_geometry(geometry, properties, id, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, tippecanoe, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, dist_sum, dist_count, want_dist, filters);
+			serialize_geometry(geometry, properties, id, reading, jp->line, layer_seq, progress_seq, metapos, geompos, indexpos, exclude, include, exclude_all, metafile, geomfile, indexfile, poolfile, treefile, fname, basezoom, layer, droprate, file_bbox, tippecanoe, segment, initialized, initial_x, initial_y, readers, maxzoom, j, layermap, layername, uses_gamma, attribute_types, zoom_rules, dist_sum, dist_count, want_dist, filters);
 		}
 
 		json_free(j);
@@ -596,7 +668,7 @@ void parse_json(json_pull *jp, const char *reading, volatile long long *layer_se
 void *run_parse_json(void *v) {
 	struct parse_json_args *pja = (struct parse_json_args *) v;
 
-	parse_json(pja->jp, pja->reading, pja->layer_seq, pja->progress_seq, pja->metapos, pja->geompos, pja->indexpos, pja->exclude, pja->include, pja->exclude_all, pja->metafile, pja->geomfile, pja->indexfile, pja->poolfile, pja->treefile, pja->fname, pja->basezoom, pja->layer, pja->droprate, pja->file_bbox, pja->segment, pja->initialized, pja->initial_x, pja->initial_y, pja->readers, pja->maxzoom, pja->layermap, *pja->layername, pja->uses_gamma, pja->attribute_types, pja->dist_sum, pja->dist_count, pja->want_dist, pja->filters);
+	parse_json(pja->jp, pja->reading, pja->layer_seq, pja->progress_seq, pja->metapos, pja->geompos, pja->indexpos, pja->exclude, pja->include, pja->exclude_all, pja->metafile, pja->geomfile, pja->indexfile, pja->poolfile, pja->treefile, pja->fname, pja->basezoom, pja->layer, pja->droprate, pja->file_bbox, pja->segment, pja->initialized, pja->initial_x, pja->initial_y, pja->readers, pja->maxzoom, pja->layermap, *pja->layername, pja->uses_gamma, pja->attribute_types, pja->zoom_rules, pja->dist_sum, pja->dist_count, pja->want_dist, pja->filters);
 
 	return NULL;
 }
@@ -7,6 +7,7 @@
 #include <string>
 #include "mbtiles.hpp"
 #include "jsonpull/jsonpull.h"
+#include "evaluator.hpp"
 
 struct parse_json_args {
 	json_pull *jp;
@@ -39,6 +40,7 @@ struct parse_json_args {
 	std::string *layername;
 	bool uses_gamma;
 	std::map<std::string, int> const *attribute_types;
+	feature_zoom_rules const *zoom_rules;
 	double *dist_sum;
 	size_t *dist_count;
 	bool want_dist;
@@ -48,7 +50,7 @@ struct parse_json_args {
 struct json_pull *json_begin_map(char *map, long long len);
 void json_end_map(struct json_pull *jp);
 
-void parse_json(json_pull *jp, const char *reading, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, char *fname, int basezoom, int layer, double droprate, long long *file_bbox, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, double *dist_sum, size_t *dist_count, bool want_dist, bool filters);
+void parse_json(json_pull *jp, const char *reading, volatile long long *layer_seq, volatile long long *progress_seq, long long *metapos, long long *geompos, long long *indexpos, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, FILE *metafile, FILE *geomfile, FILE *indexfile, struct memfile *poolfile, struct memfile *treefile, char *fname, int basezoom, int layer, double droprate, long long *file_bbox, int segment, int *initialized, unsigned *initial_x, unsigned *initial_y, struct reader *readers, int maxzoom, std::map<std::string, layermap_entry> *layermap, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, double *dist_sum, size_t *dist_count, bool want_dist, bool filters);
 void *run_parse_json(void *v);
 
 #endif
@@ -10,6 +10,9 @@
 #include <cmath>
 #include <limits.h>
 #include <sqlite3.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <mapbox/geometry/point.hpp>
 #include <mapbox/geometry/multi_polygon.hpp>
 #include <mapbox/geometry/wagyu/wagyu.hpp>
@@ -23,7 +26,7 @@
 static int pnpoly(drawvec &vert, size_t start, size_t nvert, long long testx, long long testy);
 static int clip(double *x0, double *y0, double *x1, double *y1, double xmin, double ymin, double xmax, double ymax);
 
-drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y) {
+drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y, bool importance) {
 	drawvec out;
 
 	bbox[0] = LLONG_MAX;
@@ -76,6 +79,12 @@ drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsi
 
 			d.x = wwx;
 			d.y = wwy;
+
+			if (importance) {
+				unsigned long long level;
+				deserialize_ulong_long_io(meta, &level, geompos);
+				d.importance = level;
+			}
 		}
 
 		out.push_back(d);
@@ -483,7 +492,18 @@ drawvec simple_clip_poly(drawvec &geom, long long minx, long long miny, long lon
 
 			mapbox::geometry::linear_ring<long long> lr = mapbox::geometry::wagyu::quick_clip::quick_lr_clip(ring, bbox);
 
+			// The clipper doesn't know about vertex importance, so look up
+			// the vertices that it kept to carry their importance through.
+			drawvec sorted;
+			for (size_t k = i; k < j; k++) {
+				if (geom[k].importance != 0) {
+					sorted.push_back(geom[k]);
+				}
+			}
+			std::sort(sorted.begin(), sorted.end());
+
 			if (lr.size() > 0) {
+				size_t start = out.size();
 				for (size_t k = 0; k < lr.size(); k++) {
 					if (k == 0) {
 						out.push_back(draw(VT_MOVETO, lr[k].x, lr[k].y));
@@ -492,6 +512,15 @@ drawvec simple_clip_poly(drawvec &geom, long long minx, long long miny, long lon
 					}
 				}
 
+				if (sorted.size() > 0) {
+					for (size_t k = start; k < out.size(); k++) {
+						auto found = std::lower_bound(sorted.begin(), sorted.end(), out[k]);
+						if (found != sorted.end() && *found == out[k]) {
+							out[k].importance = found->importance;
+						}
+					}
+				}
+
 				if (lr.size() > 0 && lr[0] != lr[lr.size() - 1]) {
 					out.push_back(draw(VT_LINETO, lr[0].x, lr[0].y));
 				}
@@ -514,6 +543,99 @@ drawvec simple_clip_poly(drawvec &geom, int z, int buffer) {
 	return simple_clip_poly(geom, -clip_buffer, -clip_buffer, area + clip_buffer, area + clip_buffer);
 }
 
+// Does the segment from a to b touch the rectangle from min to max?
+// Errs on the side of saying yes when the segment passes very close to a corner.
+static bool segment_touches_rect(draw const &a, draw const &b, long long min, long long max) {
+	if ((a.x < min && b.x < min) || (a.x > max && b.x > max) ||
+	    (a.y < min && b.y < min) || (a.y > max && b.y > max)) {
+		return false;
+	}
+
+	double dx = b.x - a.x;
+	double dy = b.y - a.y;
+	long long corners[4][2] = {{min, min}, {max, min}, {max, max}, {min, max}};
+	int sides = 0;
+
+	for (size_t i = 0; i < 4; i++) {
+		double cx = corners[i][0] - a.x;
+		double cy = corners[i][1] - a.y;
+		double cross = dx * cy - dy * cx;
+		double tolerance = (std::fabs(dx * cy) + std::fabs(dy * cx)) / (1LL << 50);
+
+		if (cross > tolerance) {
+			sides |= 1;
+		} else if (cross < -tolerance) {
+			sides |= 2;
+		} else {
+			return true;
+		}
+	}
+
+	// Corners on both sides of the line, and within its bounding box
+	return sides == 3;
+}
+
+// Is the tile, including its buffer, entirely inside the polygon, with no edges
+// of the polygon crossing it? If so, the feature can be replaced by full_tile_square()
+// instead of being clipped. Inside follows the positive winding rule that
+// clean_or_clip_poly() uses.
+bool tile_within_polygon(drawvec const &geom, int z, long long buffer) {
+	long long area = 1LL << (32 - z);
+	long long min = -(buffer * area / 256);
+	long long max = area + buffer * area / 256;
+	double px = area / 2.0;
+	double py = area / 2.0;
+	long long winding = 0;
+
+	for (size_t i = 0; i < geom.size(); i++) {
+		if (geom[i].op != VT_MOVETO) {
+			continue;
+		}
+
+		size_t j;
+		for (j = i + 1; j < geom.size(); j++) {
+			if (geom[j].op != VT_LINETO) {
+				break;
+			}
+		}
+
+		for (size_t k = i; k < j; k++) {
+			draw const &a = geom[k];
+			draw const &b = geom[k + 1 < j ? k + 1 : i];
+
+			if (segment_touches_rect(a, b, min, max)) {
+				return false;
+			}
+
+			// No edge is anywhere near the center of the tile, so rounding can't matter here
+			double side = (b.x - a.x) * (py - a.y) - (px - a.x) * ((double) b.y - a.y);
+			if (a.y <= py && b.y > py && side > 0) {
+				winding++;
+			} else if (a.y > py && b.y <= py && side < 0) {
+				winding--;
+			}
+		}
+
+		i = j - 1;
+	}
+
+	return winding > 0;
+}
+
+drawvec full_tile_square(int z, long long buffer) {
+	long long area = 1LL << (32 - z);
+	long long min = -(buffer * area / 256);
+	long long max = area + buffer * area / 256;
+
+	drawvec out;
+	out.push_back(draw(VT_MOVETO, min, min));
+	out.push_back(draw(VT_LINETO, max, min));
+	out.push_back(draw(VT_LINETO, max, max));
+	out.push_back(draw(VT_LINETO, min, max));
+	out.push_back(draw(VT_LINETO, min, min));
+	return out;
+}
+
 drawvec reduce_tiny_poly(drawvec &geom, int z, int detail, bool *reduced, double *accum_area) {
 	drawvec out;
 	long long pixel = (1 << (32 - detail - z)) * 2;
@@ -594,16 +716,20 @@ drawvec reduce_tiny_poly(drawvec &geom, int z, int detail, bool *reduced, double
 }
 
 drawvec clip_point(drawvec &geom, int z, long long buffer) {
-	drawvec out;
-
 	long long min = 0;
 	long long area = 1LL << (32 - z);
 
 	min -= buffer * area / 256;
 	area += buffer * area / 256;
 
+	return clip_point(geom, min, min, area, area);
+}
+
+drawvec clip_point(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy) {
+	drawvec out;
+
 	for (size_t i = 0; i < geom.size(); i++) {
-		if (geom[i].x >= min && geom[i].y >= min && geom[i].x <= area && geom[i].y <= area) {
+		if (geom[i].x >= minx && geom[i].y >= miny && geom[i].x <= maxx && geom[i].y <= maxy) {
 			out.push_back(geom[i]);
 		}
 	}
@@ -645,13 +771,17 @@ bool point_within_tile(long long x, long long y, int z, long long buffer) {
 }
 
 drawvec clip_lines(drawvec &geom, int z, long long buffer) {
-	drawvec out;
-
 	long long min = 0;
 	long long area = 1LL << (32 - z);
 	min -= buffer * area / 256;
 	area += buffer * area / 256;
 
+	return clip_lines(geom, min, min, area, area);
+}
+
+drawvec clip_lines(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy) {
+	drawvec out;
+
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (i > 0 && (geom[i - 1].op == VT_MOVETO || geom[i - 1].op == VT_LINETO) && geom[i].op == VT_LINETO) {
 			double x1 = geom[i - 1].x;
@@ -660,7 +790,7 @@ drawvec clip_lines(drawvec &geom, int z, long long buffer) {
 			double x2 = geom[i - 0].x;
 			double y2 = geom[i - 0].y;
 
-			int c = clip(&x1, &y1, &x2, &y2, min, min, area, area);
+			int c = clip(&x1, &y1, &x2, &y2, minx, miny, maxx, maxy);
 
 			if (c > 1) {  // clipped
 				out.push_back(draw(VT_MOVETO, x1, y1));
@@ -679,31 +809,184 @@ drawvec clip_lines(drawvec &geom, int z, long long buffer) {
 	return out;
 }
 
-static double square_distance_from_line(long long point_x, long long point_y, long long segA_x, long long segA_y, long long segB_x, long long segB_y) {
-	double p2x = segB_x - segA_x;
-	double p2y = segB_y - segA_y;
+// Copy the coordinates of a run of vertices into separate contiguous arrays,
+// away from the bitfields of struct draw, for square_distances_from_line().
+// The coordinates are integers well under 2^53, so they are exact as doubles.
+static void unpack_coordinates(drawvec const &geom, size_t start, size_t n, std::vector<double> &xs, std::vector<double> &ys) {
+	xs.resize(n);
+	ys.resize(n);
+
+	for (size_t i = 0; i < n; i++) {
+		xs[i] = geom[start + i].x;
+		ys[i] = geom[start + i].y;
+	}
+}
+
+// The squared distance from each point after `first` and before `second`
+// to the segment between those two, into dist. The SSE2 version does two points
+// at a time with the same operations in the same order, so the results are identical.
+static void square_distances_from_line(const double *xs, const double *ys, size_t first, size_t second, double *dist) {
+	double segA_x = xs[first];
+	double segA_y = ys[first];
+	double p2x = xs[second] - segA_x;
+	double p2y = ys[second] - segA_y;
 	double something = p2x * p2x + p2y * p2y;
-	double u = 0 == something ? 0 : ((point_x - segA_x) * p2x + (point_y - segA_y) * p2y) / something;
+	double scale = 0 == something ? 0 : 1;
+	double divisor = 0 == something ? 1 : something;
+
+	size_t i = first + 1;
+
+#ifdef __SSE2__
+	__m128d v_segA_x = _mm_set1_pd(segA_x);
+	__m128d v_segA_y = _mm_set1_pd(segA_y);
+	__m128d v_p2x = _mm_set1_pd(p2x);
+	__m128d v_p2y = _mm_set1_pd(p2y);
+	__m128d v_scale = _mm_set1_pd(scale);
+	__m128d v_divisor = _mm_set1_pd(divisor);
+	__m128d v_zero = _mm_set1_pd(0);
+	__m128d v_one = _mm_set1_pd(1);
+
+	for (; i + 1 < second; i += 2) {
+		__m128d point_x = _mm_loadu_pd(xs + i);
+		__m128d point_y = _mm_loadu_pd(ys + i);
+
+		__m128d u = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(point_x, v_segA_x), v_p2x), _mm_mul_pd(_mm_sub_pd(point_y, v_segA_y), v_p2y));
+		u = _mm_mul_pd(v_scale, _mm_div_pd(u, v_divisor));
+
+		u = _mm_min_pd(u, v_one);
+		u = _mm_max_pd(u, v_zero);
 
-	if (u > 1) {
-		u = 1;
-	} else if (u < 0) {
-		u = 0;
+		__m128d dx = _mm_sub_pd(_mm_add_pd(v_segA_x, _mm_mul_pd(u, v_p2x)), point_x);
+		__m128d dy = _mm_sub_pd(_mm_add_pd(v_segA_y, _mm_mul_pd(u, v_p2y)), point_y);
+
+		_mm_storeu_pd(dist + i, _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)));
 	}
+#endif
+
+	for (; i < second; i++) {
+		double u = scale * (((xs[i] - segA_x) * p2x + (ys[i] - segA_y) * p2y) / divisor);
 
-	double x = segA_x + u * p2x;
-	double y = segA_y + u * p2y;
+		u = u > 1 ? 1 : u;
+		u = u < 0 ? 0 : u;
 
-	double dx = x - point_x;
-	double dy = y - point_y;
+		double x = segA_x + u * p2x;
+		double y = segA_y + u * p2y;
 
-	return dx * dx + dy * dy;
+		double dx = x - xs[i];
+		double dy = y - ys[i];
+
+		dist[i] = dx * dx + dy * dy;
+	}
+}
+
+// The importance of a vertex is the largest Douglas-Peucker tolerance at which it
+// would still be kept, on a log scale with 256 steps per doubling of distance.
+// Level 1 is for vertices that would never be kept and 0 means not known.
+static unsigned short importance_level(double distance) {
+	if (distance < 1) {
+		return 1;
+	}
+
+	double level = 2 + std::floor(std::log2(distance) * 256);
+	if (level > USHRT_MAX) {
+		return USHRT_MAX;
+	}
+	return level;
+}
+
+// Run Douglas-Peucker on each line or ring with no tolerance, and record
+// for each vertex the tolerance at which it and every vertex that it depends on
+// would still be kept. Then simplify_lines() can simplify at any zoom level
+// by comparing against a threshold. The coordinates are shifted left by
+// `shift` to measure distances in world coordinates.
+struct importance_range {
+	size_t first;
+	size_t second;
+	double limit;
+
+	importance_range(size_t _first, size_t _second, double _limit) {
+		first = _first;
+		second = _second;
+		limit = _limit;
+	}
+};
+
+void compute_importance(drawvec &geom, int shift) {
+	// Scratch space, kept between calls so that small rings don't each allocate it
+	static thread_local std::stack<importance_range> recursion_stack;
+	static thread_local std::vector<double> xs, ys, dist;
+
+	for (size_t i = 0; i < geom.size(); i++) {
+		if (geom[i].op == VT_MOVETO) {
+			size_t j;
+			for (j = i + 1; j < geom.size(); j++) {
+				if (geom[j].op != VT_LINETO) {
+					break;
+				}
+			}
+
+			geom[i].importance = 0;
+			for (size_t k = i + 1; k < j; k++) {
+				geom[k].importance = 1;
+			}
+			geom[j - 1].importance = 0;
+
+			if (j - i > 2) {
+				unpack_coordinates(geom, i, j - i, xs, ys);
+				dist.resize(j - i);
+				recursion_stack.push(importance_range(0, j - 1 - i, HUGE_VAL));
+			}
+
+			while (!recursion_stack.empty()) {
+				size_t first = recursion_stack.top().first;
+				size_t second = recursion_stack.top().second;
+				double limit = recursion_stack.top().limit;
+				recursion_stack.pop();
+
+				double max_distance = 0;
+				size_t farthest_element_index = second;
+
+				square_distances_from_line(xs.data(), ys.data(), first, second, dist.data());
+
+				for (size_t k = first + 1; k < second; k++) {
+					double distance = dist[k];
+
+					if (distance > max_distance) {
+						farthest_element_index = k;
+						max_distance = distance;
+					}
+				}
+
+				if (max_distance > 0) {
+					// A vertex can't be kept at a tolerance that would drop
+					// the vertex that divided the line before it
+					double distance = std::min(std::sqrt(max_distance) * (1LL << shift), limit);
+					geom[i + farthest_element_index].importance = importance_level(distance);
+
+					if (1 < farthest_element_index - first) {
+						recursion_stack.push(importance_range(first, farthest_element_index, distance));
+					}
+					if (1 < second - farthest_element_index) {
+						recursion_stack.push(importance_range(farthest_element_index, second, distance));
+					}
+				}
+			}
+
+			i = j - 1;
+		}
+	}
 }
 
 // https://github.com/Project-OSRM/osrm-backend/blob/733d1384a40f/Algorithms/DouglasePeucker.cpp
 static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t kept, size_t retain) {
 	e = e * e;
-	std::stack<int> recursion_stack;
+
+	// Scratch space, kept between calls so that small rings don't each allocate it
+	static thread_local std::stack<int> recursion_stack;
+	static thread_local std::vector<double> xs, ys, dist;
+
+	dist.resize(n);
+	unpack_coordinates(geom, start, n, xs, ys);
 
 	{
 		int left_border = 0;
@@ -730,11 +1013,11 @@ static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t ke
 		int farthest_element_index = second;
 
 		// find index idx of element with max_distance
+		square_distances_from_line(xs.data(), ys.data(), first, second, dist.data());
+
 		int i;
 		for (i = first + 1; i < second; i++) {
-			double temp_dist = square_distance_from_line(geom[start + i].x, geom[start + i].y, geom[start + first].x, geom[start + first].y, geom[start + second].x, geom[start + second].y);
-
-			double distance = std::fabs(temp_dist);
+			double distance = dist[i];
 
 			if ((distance > e || kept < retain) && distance > max_distance) {
 				farthest_element_index = i;
@@ -759,6 +1042,42 @@ static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t ke
 	}
 }
 
+// Keep the vertices from start to end whose precomputed importance is above
+// the tolerance, along with any whose importance isn't known.
+// Returns false, leaving it to douglas_peucker(), if no importance is known
+// or if that would keep fewer than `retain` vertices.
+static bool simplify_by_importance(drawvec &geom, size_t start, size_t end, double e, size_t retain) {
+	bool known = false;
+	for (size_t k = start + 1; k + 1 < end; k++) {
+		if (geom[k].importance != 0) {
+			known = true;
+			break;
+		}
+	}
+	if (!known) {
+		return false;
+	}
+
+	unsigned short threshold = importance_level(e);
+	size_t kept = 0;
+	for (size_t k = start; k < end; k++) {
+		if (geom[k].necessary || geom[k].importance == 0 || geom[k].importance > threshold) {
+			kept++;
+		}
+	}
+	if (kept < retain) {
+		return false;
+	}
+
+	for (size_t k = start + 1; k + 1 < end; k++) {
+		if (geom[k].importance == 0 || geom[k].importance > threshold) {
+			geom[k].necessary = 1;
+		}
+	}
+
+	return true;
+}
+
 // If any line segment crosses a tile boundary, add a node there
 // that cannot be simplified away, to prevent the edge of any
 // feature from jumping abruptly at the tile boundary.
@@ -793,7 +1112,7 @@ drawvec impose_tile_boundaries(drawvec &geom, long long extent) {
 	return out;
 }
 
-drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain) {
+drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, bool use_importance) {
 	int res = 1 << (32 - detail - z);
 	long long area = 1LL << (32 - z);
 
@@ -824,7 +1143,9 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 			geom[j - 1].necessary = 1;
 
 			if (j - i > 1) {
-				douglas_peucker(geom, i, j - i, res * simplification, 2, retain);
+				if (!use_importance || !simplify_by_importance(geom, i, j, res * simplification, retain)) {
+					douglas_peucker(geom, i, j - i, res * simplification, 2, retain);
+				}
 			}
 			i = j - 1;
 		}
@@ -22,11 +22,16 @@ struct draw {
 	long long y : 40;
 	signed char necessary;
 
+	// From compute_importance(), or 0 if not known. Fits in the padding
+	// after the bitfields, so it doesn't make the struct any bigger.
+	unsigned short importance;
+
 	draw(int nop, long long nx, long long ny) {
 		this->op = nop;
 		this->x = nx;
 		this->y = ny;
 		this->necessary = 0;
+		this->importance = 0;
 	}
 
 	draw() {
@@ -34,6 +39,7 @@ struct draw {
 		this->x = 0;
 		this->y = 0;
 		this->necessary = 0;
+		this->importance = 0;
 	}
 
 	bool operator<(draw const &s) const {
@@ -55,19 +61,25 @@ struct draw {
 
 typedef std::vector<draw> drawvec;
 
-drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y);
+drawvec decode_geometry(FILE *meta, long long *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y, bool importance);
 void to_tile_scale(drawvec &geom, int z, int detail);
 drawvec remove_noop(drawvec geom, int type, int shift);
 drawvec clip_point(drawvec &geom, int z, long long buffer);
+drawvec clip_point(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy);
 drawvec clean_or_clip_poly(drawvec &geom, int z, int detail, int buffer, bool clip);
 drawvec simple_clip_poly(drawvec &geom, int z, int buffer);
+drawvec simple_clip_poly(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy);
+bool tile_within_polygon(drawvec const &geom, int z, long long buffer);
+drawvec full_tile_square(int z, long long buffer);
 drawvec close_poly(drawvec &geom);
 drawvec reduce_tiny_poly(drawvec &geom, int z, int detail, bool *reduced, double *accum_area);
 drawvec clip_lines(drawvec &geom, int z, long long buffer);
+drawvec clip_lines(drawvec &geom, long long minx, long long miny, long long maxx, long long maxy);
 drawvec stairstep(drawvec &geom, int z, int detail);
 bool point_within_tile(long long x, long long y, int z, long long buffer);
 int quick_check(long long *bbox, int z, long long buffer);
-drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain);
+drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, bool use_importance);
+void compute_importance(drawvec &geom, int shift);
 drawvec reorder_lines(drawvec &geom);
 drawvec fix_polygon(drawvec &geom);
 std::vector<drawvec> chop_polygon(std::vector<drawvec> &geoms);
@@ -55,6 +55,8 @@
 #include "options.hpp"
 #include "mvt.hpp"
 #include "dirtiles.hpp"
+#include "plugin.hpp"
+#include "evaluator.hpp"
 
 static int low_detail = 12;
 static int full_detail = -1;
@@ -373,7 +375,7 @@ void *run_sort(void *v) {
 	return NULL;
 }
 
-void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, struct reader *reader, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > *layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, struct reader *reader, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > *layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	long long segs[CPUS + 1];
 	segs[0] = 0;
 	segs[CPUS] = len;
@@ -436,6 +438,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 		pja[i].layername = &layername;
 		pja[i].uses_gamma = uses_gamma;
 		pja[i].attribute_types = attribute_types;
+		pja[i].zoom_rules = zoom_rules;
 		pja[i].dist_sum = &(dist_sums[i]);
 		pja[i].dist_count = &(dist_counts[i]);
 		pja[i].want_dist = want_dist;
@@ -488,6 +491,7 @@ struct read_parallel_arg {
 	std::string layername;
 	bool uses_gamma;
 	std::map<std::string, int> const *attribute_types;
+	feature_zoom_rules const *zoom_rules;
 	double *dist_sum;
 	size_t *dist_count;
 	bool want_dist;
@@ -513,7 +517,7 @@ void *run_read_parallel(void *v) {
 	}
 	madvise(map, rpa->len, MADV_RANDOM);  // sequential, but from several pointers at once
 
-	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->reader, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->fname, rpa->basezoom, rpa->source, rpa->nlayers, rpa->layermaps, rpa->droprate, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters);
+	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->reader, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->fname, rpa->basezoom, rpa->source, rpa->nlayers, rpa->layermaps, rpa->droprate, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->zoom_rules, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters);
 
 	madvise(map, rpa->len, MADV_DONTNEED);
 	if (munmap(map, rpa->len) != 0) {
@@ -530,7 +534,7 @@ void *run_read_parallel(void *v) {
 	return NULL;
 }
 
-void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile int *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, struct reader *reader, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > &layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile int *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, struct reader *reader, volatile long long *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, char *fname, int basezoom, int source, int nlayers, std::vector<std::map<std::string, layermap_entry> > &layermaps, double droprate, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
 	// This has to kick off an intermediate thread to start the parser threads,
 	// so the main thread can get back to reading the next input stage while
 	// the intermediate thread waits for the completion of the parser threads.
@@ -569,6 +573,7 @@ void start_parsing(int fd, FILE *fp, long long offset, long long len, volatile i
 	rpa->layername = layername;
 	rpa->uses_gamma = uses_gamma;
 	rpa->attribute_types = attribute_types;
+	rpa->zoom_rules = zoom_rules;
 	rpa->dist_sum = dist_sum;
 	rpa->dist_count = dist_count;
 	rpa->want_dist = want_dist;
@@ -903,16 +908,7 @@ void prep_drop_states(struct drop_state *ds, int maxzoom, int basezoom, double d
 	}
 }
 
-void radix(struct reader *reader, int nreaders, FILE *geomfile, int geomfd, FILE *indexfile, int indexfd, const char *tmpdir, long long *geompos, int maxzoom, int basezoom, double droprate, double gamma) {
-	// Run through the index and geometry for each reader,
-	// splitting the contents out by index into as many
-	// sub-files as we can write to simultaneously.
-
-	// Then sort each of those by index, recursively if it is
-	// too big to fit in memory.
-
-	// Then concatenate each of the sub-outputs into a final output.
-
+long long physical_memory() {
 	long long mem;
 
 #ifdef __APPLE__
@@ -934,6 +930,21 @@ void radix(struct reader *reader, int nreaders, FILE *geomfile, int geomfd, FILE
 	mem = (long long) pages * pagesize;
 #endif
 
+	return mem;
+}
+
+void radix(struct reader *reader, int nreaders, FILE *geomfile, int geomfd, FILE *indexfile, int indexfd, const char *tmpdir, long long *geompos, int maxzoom, int basezoom, double droprate, double gamma) {
+	// Run through the index and geometry for each reader,
+	// splitting the contents out by index into as many
+	// sub-files as we can write to simultaneously.
+
+	// Then sort each of those by index, recursively if it is
+	// too big to fit in memory.
+
+	// Then concatenate each of the sub-outputs into a final output.
+
+	long long mem = physical_memory();
+
 	// Just for code coverage testing. Deeply recursive sorting is very slow
 	// compared to sorting in memory.
 	if (additional[A_PREFER_RADIX_SORT]) {
@@ -1031,7 +1042,7 @@ void choose_first_zoom(long long *file_bbox, struct reader *reader, unsigned *iz
 	}
 }
 
-int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm) {
+int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, feature_filter const *filter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, feature_zoom_rules const *zoom_rules, const char *pgm) {
 	int ret = EXIT_SUCCESS;
 
 	struct reader reader[CPUS];
@@ -1260,7 +1271,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 
 		if (map != NULL && map != MAP_FAILED && read_parallel_this) {
-			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, &layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, uses_gamma, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, &layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, uses_gamma, attribute_types, zoom_rules, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
 			overall_offset += st.st_size - off;
 			checkdisk(reader, CPUS);
 
@@ -1336,7 +1347,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 							}
 
 							fflush(readfp);
-							start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+							start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, zoom_rules, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
 
 							initial_offset += ahead;
 							overall_offset += ahead;
@@ -1373,7 +1384,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				fflush(readfp);
 
 				if (ahead > 0) {
-					start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+					start_parsing(readfd, readfp, initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), reader, &progress_seq, exclude, include, exclude_all, fname, basezoom, layer, nlayers, layermaps, droprate, initialized, initial_x, initial_y, maxzoom, sources[layer].layer, gamma != 0, attribute_types, zoom_rules, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
 
 					if (parser_created) {
 						if (pthread_join(parallel_parser, NULL) != 0) {
@@ -1390,7 +1401,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 
 				long long layer_seq = overall_offset;
 				json_pull *jp = json_begin_file(fp);
-				parse_json(jp, reading.c_str(), &layer_seq, &progress_seq, &reader[0].metapos, &reader[0].geompos, &reader[0].indexpos, exclude, include, exclude_all, reader[0].metafile, reader[0].geomfile, reader[0].indexfile, reader[0].poolfile, reader[0].treefile, fname, basezoom, layer, droprate, reader[0].file_bbox, 0, &initialized[0], &initial_x[0], &initial_y[0], reader, maxzoom, &layermaps[0], sources[layer].layer, uses_gamma, attribute_types, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+				parse_json(jp, reading.c_str(), &layer_seq, &progress_seq, &reader[0].metapos, &reader[0].geompos, &reader[0].indexpos, exclude, include, exclude_all, reader[0].metafile, reader[0].geomfile, reader[0].indexfile, reader[0].poolfile, reader[0].treefile, fname, basezoom, layer, droprate, reader[0].file_bbox, 0, &initialized[0], &initial_x[0], &initial_y[0], reader, maxzoom, &layermaps[0], sources[layer].layer, uses_gamma, attribute_types, zoom_rules, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
 				json_end(jp);
 				overall_offset = layer_seq;
 				checkdisk(reader, CPUS);
@@ -1933,7 +1944,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	}
 
 	unsigned midx = 0, midy = 0;
-	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, basezoom, outdb, outdir, droprate, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter);
+	int written = traverse_zooms(fd, size, meta, stringpool, &midx, &midy, maxzoom, minzoom, basezoom, outdb, outdir, droprate, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, meta_off, pool_off, initial_x, initial_y, simplification, layermaps, prefilter, postfilter, filter);
+	finish_filters();
 
 	if (maxzoom != written) {
 		fprintf(stderr, "\n\n\n*** NOTE TILES ONLY COMPLETE THROUGH ZOOM %d ***\n\n\n", written);
@@ -2042,6 +2054,35 @@ void set_attribute_type(std::map<std::string, int> &attribute_types, const char
 	attribute_types.insert(std::pair<std::string, int>(name, t));
 }
 
+std::string read_json_file(const char *fname) {
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	std::string json;
+	char buf[2000];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		json.append(buf, n);
+	}
+	if (fclose(fp) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	return json;
+}
+
+// Values for long options that have no single-letter equivalent
+#define OPT_COMPRESSION_LEVEL 1
+#define OPT_SQLITE_PAGE_SIZE 2
+#define OPT_SQLITE_CACHE_SIZE 3
+#define OPT_PERSISTENT_FILTERS 4
+#define OPT_ZOOM_RULES 5
+#define OPT_ZOOM_RULES_FILE 6
+
 int main(int argc, char **argv) {
 #ifdef MTRACE
 	mtrace();
@@ -2073,6 +2114,8 @@ int main(int argc, char **argv) {
 	std::vector<source> sources;
 	const char *prefilter = NULL;
 	const char *postfilter = NULL;
+	feature_filter *filter = NULL;
+	feature_zoom_rules *zoom_rules = NULL;
 	bool guess_maxzoom = false;
 
 	std::set<std::string> exclude, include;
@@ -2092,6 +2135,9 @@ int main(int argc, char **argv) {
 		{"output-to-directory", required_argument, 0, 'e'},
 		{"force", no_argument, 0, 'f'},
 		{"allow-existing", no_argument, 0, 'F'},
+		{"sqlite-page-size", required_argument, 0, OPT_SQLITE_PAGE_SIZE},
+		{"sqlite-cache-size", required_argument, 0, OPT_SQLITE_CACHE_SIZE},
+		{"deduplicate-tiles", no_argument, &mbtiles_deduplicate, 1},
 
 		{"Tileset description and attribution", 0, 0, 0},
 		{"name", required_argument, 0, 'n'},
@@ -2124,6 +2170,12 @@ int main(int argc, char **argv) {
 		{"exclude-all", no_argument, 0, 'X'},
 		{"attribute-type", required_argument, 0, 'T'},
 
+		{"Filtering features by attributes", 0, 0, 0},
+		{"feature-filter-file", required_argument, 0, 'J'},
+		{"feature-filter", required_argument, 0, 'j'},
+		{"zoom-rules-file", required_argument, 0, OPT_ZOOM_RULES_FILE},
+		{"zoom-rules", required_argument, 0, OPT_ZOOM_RULES},
+
 		{"Dropping a fixed fraction of features by zoom level", 0, 0, 0},
 		{"drop-rate", required_argument, 0, 'r'},
 		{"base-zoom", required_argument, 0, 'B'},
@@ -2135,6 +2187,7 @@ int main(int argc, char **argv) {
 		{"drop-fraction-as-needed", no_argument, &additional[A_DROP_FRACTION_AS_NEEDED], 1},
 		{"drop-smallest-as-needed", no_argument, &additional[A_DROP_SMALLEST_AS_NEEDED], 1},
 		{"force-feature-limit", no_argument, &prevent[P_DYNAMIC_DROP], 1},
+		{"predict-tile-sizes", no_argument, &additional[A_PREDICT_TILE_SIZES], 1},
 
 		{"Dropping tightly overlapping features", 0, 0, 0},
 		{"gamma", required_argument, 0, 'g'},
@@ -2144,6 +2197,7 @@ int main(int argc, char **argv) {
 		{"simplification", required_argument, 0, 'S'},
 		{"no-line-simplification", no_argument, &prevent[P_SIMPLIFY], 1},
 		{"simplify-only-low-zooms", no_argument, &prevent[P_SIMPLIFY_LOW], 1},
+		{"precompute-vertex-importance", no_argument, &additional[A_VERTEX_IMPORTANCE], 1},
 		{"no-tiny-polygon-reduction", no_argument, &prevent[P_TINY_POLYGON_REDUCTION], 1},
 
 		{"Attempts to improve shared polygon boundaries", 0, 0, 0},
@@ -2170,15 +2224,20 @@ int main(int argc, char **argv) {
 		{"Filtering tile contents", 0, 0, 0},
 		{"prefilter", required_argument, 0, 'C'},
 		{"postfilter", required_argument, 0, 'c'},
+		{"postfilter-mvt", no_argument, &additional[A_POSTFILTER_MVT], 1},
+		{"persistent-filters", required_argument, 0, OPT_PERSISTENT_FILTERS},
 
 		{"Setting or disabling tile size limits", 0, 0, 0},
 		{"maximum-tile-bytes", required_argument, 0, 'M'},
 		{"no-feature-limit", no_argument, &prevent[P_FEATURE_LIMIT], 1},
 		{"no-tile-size-limit", no_argument, &prevent[P_KILOBYTE_LIMIT], 1},
 		{"no-tile-compression", no_argument, &prevent[P_TILE_COMPRESSION], 1},
+		{"compression-level", required_argument, 0, OPT_COMPRESSION_LEVEL},
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"no-zoom-pipelining", no_argument, &prevent[P_ZOOM_PIPELINING], 1},
+		{"clip-to-child-tiles", no_argument, &additional[A_CLIP_TO_CHILD_TILES], 1},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
@@ -2445,6 +2504,30 @@ int main(int argc, char **argv) {
 			max_tile_size = atoll(optarg);
 			break;
 
+		case OPT_SQLITE_PAGE_SIZE:
+			mbtiles_page_size = atoi(optarg);
+			if (mbtiles_page_size < 512 || mbtiles_page_size > 65536 || (mbtiles_page_size & (mbtiles_page_size - 1)) != 0) {
+				fprintf(stderr, "%s: --sqlite-page-size must be a power of 2 between 512 and 65536\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_SQLITE_CACHE_SIZE:
+			mbtiles_cache_size = atoll(optarg);
+			if (mbtiles_cache_size <= 0) {
+				fprintf(stderr, "%s: --sqlite-cache-size must be positive\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_COMPRESSION_LEVEL:
+			compression_level = atoi(optarg);
+			if (compression_level < 0 || compression_level > 9) {
+				fprintf(stderr, "%s: --compression-level must be between 0 and 9\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'c':
 			postfilter = optarg;
 			break;
@@ -2453,6 +2536,30 @@ int main(int argc, char **argv) {
 			prefilter = optarg;
 			break;
 
+		case 'j':
+			filter = parse_feature_filter(optarg, "--feature-filter");
+			break;
+
+		case 'J':
+			filter = parse_feature_filter(read_json_file(optarg).c_str(), optarg);
+			break;
+
+		case OPT_ZOOM_RULES:
+			zoom_rules = parse_zoom_rules(optarg, "--zoom-rules");
+			break;
+
+		case OPT_ZOOM_RULES_FILE:
+			zoom_rules = parse_zoom_rules(read_json_file(optarg).c_str(), optarg);
+			break;
+
+		case OPT_PERSISTENT_FILTERS:
+			filter_processes = atoi(optarg);
+			if (filter_processes <= 0) {
+				fprintf(stderr, "%s: --persistent-filters must be positive\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'T':
 			set_attribute_type(attribute_types, optarg);
 			break;
@@ -2599,9 +2706,12 @@ int main(int argc, char **argv) {
 
 	long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
 
-	ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, description, guess_maxzoom, &attribute_types, argv[0]);
+	ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, filter, description, guess_maxzoom, &attribute_types, zoom_rules, argv[0]);
 
 	if (outdb != NULL) {
+		if (!quiet) {
+			mbtiles_report_deduplication(outdb);
+		}
 		mbtiles_close(outdb, argv[0]);
 	}
 
@@ -19,11 +19,13 @@ extern int quiet;
 
 extern size_t CPUS;
 extern size_t TEMP_FILES;
+extern long long MAX_FILES;
 
 extern size_t max_tile_size;
 
 int mkstemp_cloexec(char *name);
 FILE *fopen_oflag(const char *name, const char *mode, int oflag);
+long long physical_memory();
 
 #define MAX_ZOOM 24
 
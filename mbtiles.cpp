@@ -15,6 +15,87 @@
 #include "mbtiles.hpp"
 #include "text.hpp"
 
+int mbtiles_page_size = 0;
+long long mbtiles_cache_size = 0;
+int mbtiles_deduplicate = 0;
+
+// Tile inserts are grouped into transactions of this many tiles or bytes,
+// whichever comes first, instead of each being committed on its own
+#define TRANSACTION_TILES 10000
+#define TRANSACTION_BYTES (64 * 1024 * 1024)
+
+struct mbtiles_output {
+	sqlite3_stmt *insert = NULL;
+
+	// For the map and images schema, where each distinct tile is only stored once
+	bool deduplicate = false;
+	sqlite3_stmt *find_image = NULL;
+	sqlite3_stmt *insert_image = NULL;
+	size_t tiles_written = 0;
+	size_t images_written = 0;
+
+	bool in_transaction = false;
+	size_t tiles = 0;
+	size_t bytes = 0;
+};
+
+// Indexed by connection. Like the connection itself, only used by one thread at a time.
+static std::map<sqlite3 *, mbtiles_output> outputs;
+
+static void mbtiles_commit(sqlite3 *outdb) {
+	auto o = outputs.find(outdb);
+	if (o == outputs.end() || !o->second.in_transaction) {
+		return;
+	}
+
+	char *err;
+	if (sqlite3_exec(outdb, "COMMIT;", NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 commit failed: %s\n", err);
+		exit(EXIT_FAILURE);
+	}
+
+	o->second.in_transaction = false;
+	o->second.tiles = 0;
+	o->second.bytes = 0;
+}
+
+static long long mbtiles_page_count(sqlite3 *outdb) {
+	long long count = 0;
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(outdb, "PRAGMA page_count;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 page count failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		count = sqlite3_column_int64(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+
+	return count;
+}
+
+// Returns "table" or "view" if the database already has one by that name, or "" if not
+static std::string schema_type(sqlite3 *outdb, const char *name) {
+	std::string type;
+	sqlite3_stmt *stmt;
+
+	if (sqlite3_prepare_v2(outdb, "SELECT type FROM sqlite_master WHERE name = ?;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 schema query failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		const unsigned char *s = sqlite3_column_text(stmt, 0);
+		if (s != NULL) {
+			type = (const char *) s;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	return type;
+}
+
 sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 	sqlite3 *outdb;
 
@@ -24,6 +105,25 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 	}
 
 	char *err = NULL;
+	if (mbtiles_page_size != 0 && mbtiles_page_count(outdb) != 0) {
+		// Only a new, empty database can be given a page size
+		fprintf(stderr, "%s: %s: --sqlite-page-size has no effect on an existing file\n", argv[0], dbname);
+	} else if (mbtiles_page_size != 0) {
+		// Has to be set before the first table is created
+		std::string sql = "PRAGMA page_size=" + std::to_string(mbtiles_page_size);
+		if (sqlite3_exec(outdb, sql.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: page size: %s\n", argv[0], err);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (mbtiles_cache_size != 0) {
+		// Negative cache sizes are in kibibytes instead of pages
+		std::string sql = "PRAGMA cache_size=" + std::to_string(-mbtiles_cache_size);
+		if (sqlite3_exec(outdb, sql.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: cache size: %s\n", argv[0], err);
+			exit(EXIT_FAILURE);
+		}
+	}
 	if (sqlite3_exec(outdb, "PRAGMA synchronous=0", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: async: %s\n", argv[0], err);
 		exit(EXIT_FAILURE);
@@ -42,10 +142,44 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+
+	// With -F, an existing tiles table can't be turned into a view or the other way around,
+	// and the tiles would silently go somewhere that the tileset doesn't read them from.
+	std::string tiles_type = schema_type(outdb, "tiles");
+	if (mbtiles_deduplicate && tiles_type == "table") {
+		fprintf(stderr, "%s: %s: already has a tiles table, so it can't hold deduplicated tiles\n", argv[0], dbname);
+		exit(EXIT_FAILURE);
+	}
+	if (!mbtiles_deduplicate && tiles_type == "view") {
+		fprintf(stderr, "%s: %s: holds deduplicated tiles, so --deduplicate-tiles is needed to add to it\n", argv[0], dbname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (mbtiles_deduplicate) {
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
@@ -54,37 +188,179 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (mbtiles_deduplicate) {
+		if (sqlite3_exec(outdb, "create unique index map_index on map (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index map: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 
+	outputs[outdb].deduplicate = mbtiles_deduplicate;
+
 	return outdb;
 }
 
+static void prepare(sqlite3 *outdb, const char *query, sqlite3_stmt **stmt) {
+	if (*stmt == NULL) {
+		if (sqlite3_prepare_v2(outdb, query, -1, stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 prep failed: %s: %s\n", query, sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static unsigned long long fnv1a(const char *data, int size) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (int i = 0; i < size; i++) {
+		h ^= (unsigned char) data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Returns the tile_id of the image with these contents, adding it to the images table
+// if it isn't there already. The hash is only a hint: if two different tiles hash alike,
+// the second gets a suffix on its id.
+static std::string find_or_insert_image(sqlite3 *outdb, mbtiles_output &o, const char *data, int size) {
+	prepare(outdb, "select tile_data from images where tile_id = ?", &o.find_image);
+	prepare(outdb, "insert into images (tile_data, tile_id) values (?, ?)", &o.insert_image);
+
+	char hash[17];
+	sprintf(hash, "%016llx", fnv1a(data, size));
+
+	for (size_t collision = 0;; collision++) {
+		std::string id = hash;
+		if (collision > 0) {
+			id += "-" + std::to_string(collision);
+		}
+
+		sqlite3_bind_text(o.find_image, 1, id.c_str(), id.size(), SQLITE_STATIC);
+		int found = sqlite3_step(o.find_image);
+		bool same = false;
+		if (found == SQLITE_ROW) {
+			same = sqlite3_column_bytes(o.find_image, 0) == size && memcmp(sqlite3_column_blob(o.find_image, 0), data, size) == 0;
+		}
+		sqlite3_reset(o.find_image);
+		sqlite3_clear_bindings(o.find_image);
+
+		if (found == SQLITE_ROW) {
+			if (same) {
+				return id;
+			}
+			continue;
+		}
+
+		sqlite3_bind_blob(o.insert_image, 1, data, size, NULL);
+		sqlite3_bind_text(o.insert_image, 2, id.c_str(), id.size(), SQLITE_STATIC);
+		if (sqlite3_step(o.insert_image) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
+		}
+		sqlite3_reset(o.insert_image);
+		sqlite3_clear_bindings(o.insert_image);
+
+		o.images_written++;
+		o.bytes += size;
+		return id;
+	}
+}
+
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
-	sqlite3_stmt *stmt;
-	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
-	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 insert prep failed\n");
-		exit(EXIT_FAILURE);
+	mbtiles_output &o = outputs[outdb];
+
+	if (o.deduplicate) {
+		prepare(outdb, "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)", &o.insert);
+	} else {
+		prepare(outdb, "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)", &o.insert);
+	}
+
+	if (!o.in_transaction) {
+		char *err;
+		if (sqlite3_exec(outdb, "BEGIN;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 begin transaction failed: %s\n", err);
+			exit(EXIT_FAILURE);
+		}
+		o.in_transaction = true;
 	}
 
-	sqlite3_bind_int(stmt, 1, z);
-	sqlite3_bind_int(stmt, 2, tx);
-	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_blob(stmt, 4, data, size, NULL);
+	std::string id;
+	sqlite3_bind_int(o.insert, 1, z);
+	sqlite3_bind_int(o.insert, 2, tx);
+	sqlite3_bind_int(o.insert, 3, (1 << z) - 1 - ty);
+	if (o.deduplicate) {
+		id = find_or_insert_image(outdb, o, data, size);
+		sqlite3_bind_text(o.insert, 4, id.c_str(), id.size(), SQLITE_STATIC);
+	} else {
+		sqlite3_bind_blob(o.insert, 4, data, size, NULL);
+		o.bytes += size;
+	}
 
-	if (sqlite3_step(stmt) != SQLITE_DONE) {
+	if (sqlite3_step(o.insert) != SQLITE_DONE) {
 		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
 	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
+	sqlite3_reset(o.insert);
+	sqlite3_clear_bindings(o.insert);
+
+	o.tiles++;
+	o.tiles_written++;
+	if (o.tiles >= TRANSACTION_TILES || o.bytes >= TRANSACTION_BYTES) {
+		mbtiles_commit(outdb);
 	}
 }
 
+void mbtiles_erase_zooms(sqlite3 *outdb, int maxzoom) {
+	mbtiles_commit(outdb);
+
+	std::vector<std::string> queries;
+	auto o = outputs.find(outdb);
+	if (o != outputs.end() && o->second.deduplicate) {
+		queries.push_back("DELETE FROM map WHERE zoom_level > ?;");
+		queries.push_back("DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);");
+	} else {
+		queries.push_back("DELETE FROM tiles WHERE zoom_level > ?;");
+	}
+
+	for (size_t i = 0; i < queries.size(); i++) {
+		sqlite3_stmt *stmt;
+		if (sqlite3_prepare_v2(outdb, queries[i].c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 prep failed: %s: %s\n", queries[i].c_str(), sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+		if (sqlite3_bind_parameter_count(stmt) > 0) {
+			sqlite3_bind_int(stmt, 1, maxzoom);
+		}
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+		sqlite3_finalize(stmt);
+	}
+}
+
+void mbtiles_report_deduplication(sqlite3 *outdb) {
+	auto o = outputs.find(outdb);
+	if (o == outputs.end() || !o->second.deduplicate || o->second.tiles_written == 0) {
+		return;
+	}
+
+	fprintf(stderr, "%zu tiles stored as %zu distinct images (%.2f%% duplicates)\n", o->second.tiles_written, o->second.images_written,
+		100.0 * (o->second.tiles_written - o->second.images_written) / o->second.tiles_written);
+}
+
 static void quote(std::string &buf, std::string const &s) {
 	for (size_t i = 0; i < s.size(); i++) {
 		unsigned char ch = s[i];
@@ -303,7 +579,9 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 	char *sql, *err;
 
 	sqlite3 *db = outdb;
-	if (outdb == NULL) {
+	if (outdb != NULL) {
+		mbtiles_commit(outdb);
+	} else {
 		if (sqlite3_open("", &db) != SQLITE_OK) {
 			fprintf(stderr, "Temporary db: %s\n", sqlite3_errmsg(db));
 			exit(EXIT_FAILURE);
@@ -512,6 +790,18 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 void mbtiles_close(sqlite3 *outdb, const char *pgm) {
 	char *err;
 
+	mbtiles_commit(outdb);
+	auto o = outputs.find(outdb);
+	if (o != outputs.end()) {
+		sqlite3_stmt *stmts[] = {o->second.insert, o->second.find_image, o->second.insert_image};
+		for (sqlite3_stmt *stmt : stmts) {
+			if (stmt != NULL && sqlite3_finalize(stmt) != SQLITE_OK) {
+				fprintf(stderr, "%s: sqlite3 finalize failed: %s\n", pgm, sqlite3_errmsg(outdb));
+			}
+		}
+		outputs.erase(o);
+	}
+
 	if (sqlite3_exec(outdb, "ANALYZE;", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: ANALYZE failed: %s\n", pgm, err);
 		exit(EXIT_FAILURE);
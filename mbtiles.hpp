@@ -35,9 +35,20 @@ struct layermap_entry {
 	}
 };
 
+// SQLite page size in bytes and cache size in kibibytes, or 0 for SQLite's defaults
+extern int mbtiles_page_size;
+extern long long mbtiles_cache_size;
+
+// Store each distinct tile only once, using the map and images schema with a tiles view
+extern int mbtiles_deduplicate;
+
 sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
 
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+void mbtiles_report_deduplication(sqlite3 *outdb);
+
+// Removes the tiles of zoom levels deeper than maxzoom
+void mbtiles_erase_zooms(sqlite3 *outdb, int maxzoom);
 
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description);
 
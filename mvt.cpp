@@ -23,16 +23,54 @@ bool is_compressed(std::string const &data) {
 	return data.size() > 2 && (((uint8_t) data[0] == 0x78 && (uint8_t) data[1] == 0x9C) || ((uint8_t) data[0] == 0x1F && (uint8_t) data[1] == 0x8B));
 }
 
+int compression_level = Z_BEST_COMPRESSION;
+
+// Each thread keeps its zlib streams from one tile to the next and resets them,
+// instead of allocating and initializing new ones for every tile.
+
+struct inflater {
+	z_stream s;
+	bool initialized = false;
+
+	~inflater() {
+		if (initialized) {
+			inflateEnd(&s);
+		}
+	}
+};
+
+struct deflater {
+	z_stream s;
+	bool initialized = false;
+	int level;
+
+	~deflater() {
+		if (initialized) {
+			deflateEnd(&s);
+		}
+	}
+};
+
+static thread_local inflater thread_inflater;
+static thread_local deflater thread_deflater;
+
 // https://github.com/mapbox/mapnik-vector-tile/blob/master/src/vector_tile_compression.hpp
 int decompress(std::string const &input, std::string &output) {
-	z_stream inflate_s;
-	inflate_s.zalloc = Z_NULL;
-	inflate_s.zfree = Z_NULL;
-	inflate_s.opaque = Z_NULL;
-	inflate_s.avail_in = 0;
-	inflate_s.next_in = Z_NULL;
-	if (inflateInit2(&inflate_s, 32 + 15) != Z_OK) {
-		fprintf(stderr, "error: %s\n", inflate_s.msg);
+	z_stream &inflate_s = thread_inflater.s;
+	if (thread_inflater.initialized) {
+		if (inflateReset(&inflate_s) != Z_OK) {
+			fprintf(stderr, "error: %s\n", inflate_s.msg);
+		}
+	} else {
+		inflate_s.zalloc = Z_NULL;
+		inflate_s.zfree = Z_NULL;
+		inflate_s.opaque = Z_NULL;
+		inflate_s.avail_in = 0;
+		inflate_s.next_in = Z_NULL;
+		if (inflateInit2(&inflate_s, 32 + 15) != Z_OK) {
+			fprintf(stderr, "error: %s\n", inflate_s.msg);
+		}
+		thread_inflater.initialized = true;
 	}
 	inflate_s.next_in = (Bytef *) input.data();
 	inflate_s.avail_in = input.size();
@@ -49,20 +87,29 @@ int decompress(std::string const &input, std::string &output) {
 
 		length += (2 * input.size() - inflate_s.avail_out);
 	} while (inflate_s.avail_out == 0);
-	inflateEnd(&inflate_s);
 	output.resize(length);
 	return 1;
 }
 
 // https://github.com/mapbox/mapnik-vector-tile/blob/master/src/vector_tile_compression.hpp
 int compress(std::string const &input, std::string &output) {
-	z_stream deflate_s;
-	deflate_s.zalloc = Z_NULL;
-	deflate_s.zfree = Z_NULL;
-	deflate_s.opaque = Z_NULL;
-	deflate_s.avail_in = 0;
-	deflate_s.next_in = Z_NULL;
-	deflateInit2(&deflate_s, Z_BEST_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	z_stream &deflate_s = thread_deflater.s;
+	if (thread_deflater.initialized && thread_deflater.level != compression_level) {
+		deflateEnd(&deflate_s);
+		thread_deflater.initialized = false;
+	}
+	if (thread_deflater.initialized) {
+		deflateReset(&deflate_s);
+	} else {
+		deflate_s.zalloc = Z_NULL;
+		deflate_s.zfree = Z_NULL;
+		deflate_s.opaque = Z_NULL;
+		deflate_s.avail_in = 0;
+		deflate_s.next_in = Z_NULL;
+		deflateInit2(&deflate_s, compression_level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+		thread_deflater.initialized = true;
+		thread_deflater.level = compression_level;
+	}
 	deflate_s.next_in = (Bytef *) input.data();
 	deflate_s.avail_in = input.size();
 	size_t length = 0;
@@ -77,179 +124,202 @@ int compress(std::string const &input, std::string &output) {
 		}
 		length += (increase - deflate_s.avail_out);
 	} while (deflate_s.avail_out == 0);
-	deflateEnd(&deflate_s);
 	output.resize(length);
 	return 0;
 }
 
-bool mvt_tile::decode(std::string &message, bool &was_compressed) {
-	layers.clear();
-	std::string src;
-
-	if (is_compressed(message)) {
-		std::string uncompressed;
-		decompress(message, uncompressed);
-		src = uncompressed;
-		was_compressed = true;
-	} else {
-		src = message;
-		was_compressed = false;
-	}
+// Decodes one layer message into layer, leaving out the feature geometries unless geometry is set
+static void decode_layer(protozero::pbf_reader layer_reader, mvt_layer &layer, bool geometry) {
+	while (layer_reader.next()) {
+		switch (layer_reader.tag()) {
+		case 1: /* name */
+			layer.name = layer_reader.get_string();
+			break;
 
-	protozero::pbf_reader reader(src);
+		case 3: /* key */
+			layer.keys.push_back(layer_reader.get_string());
+			break;
 
-	while (reader.next()) {
-		switch (reader.tag()) {
-		case 3: /* layer */
+		case 4: /* value */
 		{
-			protozero::pbf_reader layer_reader(reader.get_message());
-			mvt_layer layer;
+			protozero::pbf_reader value_reader(layer_reader.get_message());
+			mvt_value value;
+
+			while (value_reader.next()) {
+				switch (value_reader.tag()) {
+				case 1: /* string */
+					value.type = mvt_string;
+					value.string_value = value_reader.get_string();
+					break;
 
-			while (layer_reader.next()) {
-				switch (layer_reader.tag()) {
-				case 1: /* name */
-					layer.name = layer_reader.get_string();
+				case 2: /* float */
+					value.type = mvt_float;
+					value.numeric_value.float_value = value_reader.get_float();
 					break;
 
-				case 3: /* key */
-					layer.keys.push_back(layer_reader.get_string());
+				case 3: /* double */
+					value.type = mvt_double;
+					value.numeric_value.double_value = value_reader.get_double();
 					break;
 
-				case 4: /* value */
-				{
-					protozero::pbf_reader value_reader(layer_reader.get_message());
-					mvt_value value;
-
-					while (value_reader.next()) {
-						switch (value_reader.tag()) {
-						case 1: /* string */
-							value.type = mvt_string;
-							value.string_value = value_reader.get_string();
-							break;
-
-						case 2: /* float */
-							value.type = mvt_float;
-							value.numeric_value.float_value = value_reader.get_float();
-							break;
-
-						case 3: /* double */
-							value.type = mvt_double;
-							value.numeric_value.double_value = value_reader.get_double();
-							break;
-
-						case 4: /* int */
-							value.type = mvt_int;
-							value.numeric_value.int_value = value_reader.get_int64();
-							break;
-
-						case 5: /* uint */
-							value.type = mvt_uint;
-							value.numeric_value.uint_value = value_reader.get_uint64();
-							break;
-
-						case 6: /* sint */
-							value.type = mvt_sint;
-							value.numeric_value.sint_value = value_reader.get_sint64();
-							break;
-
-						case 7: /* bool */
-							value.type = mvt_bool;
-							value.numeric_value.bool_value = value_reader.get_bool();
-							break;
-
-						default:
-							value_reader.skip();
-							break;
-						}
-					}
+				case 4: /* int */
+					value.type = mvt_int;
+					value.numeric_value.int_value = value_reader.get_int64();
+					break;
 
-					layer.values.push_back(value);
+				case 5: /* uint */
+					value.type = mvt_uint;
+					value.numeric_value.uint_value = value_reader.get_uint64();
+					break;
+
+				case 6: /* sint */
+					value.type = mvt_sint;
+					value.numeric_value.sint_value = value_reader.get_sint64();
 					break;
-				}
 
-				case 5: /* extent */
-					layer.extent = layer_reader.get_uint32();
+				case 7: /* bool */
+					value.type = mvt_bool;
+					value.numeric_value.bool_value = value_reader.get_bool();
 					break;
 
-				case 15: /* version */
-					layer.version = layer_reader.get_uint32();
+				default:
+					value_reader.skip();
+					break;
+				}
+			}
+
+			layer.values.push_back(value);
+			break;
+		}
+
+		case 5: /* extent */
+			layer.extent = layer_reader.get_uint32();
+			break;
+
+		case 15: /* version */
+			layer.version = layer_reader.get_uint32();
+			break;
+
+		case 2: /* feature */
+		{
+			protozero::pbf_reader feature_reader(layer_reader.get_message());
+			mvt_feature feature;
+			std::vector<uint32_t> geoms;
+
+			while (feature_reader.next()) {
+				switch (feature_reader.tag()) {
+				case 1: /* id */
+					feature.id = feature_reader.get_uint64();
+					feature.has_id = true;
 					break;
 
-				case 2: /* feature */
+				case 2: /* tag */
 				{
-					protozero::pbf_reader feature_reader(layer_reader.get_message());
-					mvt_feature feature;
-					std::vector<uint32_t> geoms;
-
-					while (feature_reader.next()) {
-						switch (feature_reader.tag()) {
-						case 1: /* id */
-							feature.id = feature_reader.get_uint64();
-							feature.has_id = true;
-							break;
-
-						case 2: /* tag */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								feature.tags.push_back(*it);
-							}
-							break;
-						}
-
-						case 3: /* feature type */
-							feature.type = feature_reader.get_enum();
-							break;
-
-						case 4: /* geometry */
-						{
-							auto pi = feature_reader.get_packed_uint32();
-							for (auto it = pi.first; it != pi.second; ++it) {
-								geoms.push_back(*it);
-							}
-							break;
-						}
-
-						default:
-							feature_reader.skip();
-							break;
-						}
+					auto pi = feature_reader.get_packed_uint32();
+					for (auto it = pi.first; it != pi.second; ++it) {
+						feature.tags.push_back(*it);
 					}
+					break;
+				}
 
-					long long px = 0, py = 0;
-					for (size_t g = 0; g < geoms.size(); g++) {
-						uint32_t geom = geoms[g];
-						uint32_t op = geom & 7;
-						uint32_t count = geom >> 3;
-
-						if (op == mvt_moveto || op == mvt_lineto) {
-							for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
-								px += protozero::decode_zigzag32(geoms[g + 1]);
-								py += protozero::decode_zigzag32(geoms[g + 2]);
-								g += 2;
-
-								feature.geometry.push_back(mvt_geometry(op, px, py));
-							}
-						} else {
-							feature.geometry.push_back(mvt_geometry(op, 0, 0));
-						}
+				case 3: /* feature type */
+					feature.type = feature_reader.get_enum();
+					break;
+
+				case 4: /* geometry */
+				{
+					if (!geometry) {
+						feature_reader.skip();
+						break;
 					}
 
-					layer.features.push_back(feature);
+					auto pi = feature_reader.get_packed_uint32();
+					for (auto it = pi.first; it != pi.second; ++it) {
+						geoms.push_back(*it);
+					}
 					break;
 				}
 
 				default:
-					layer_reader.skip();
+					feature_reader.skip();
 					break;
 				}
 			}
 
-			for (size_t i = 0; i < layer.keys.size(); i++) {
-				layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+			long long px = 0, py = 0;
+			for (size_t g = 0; g < geoms.size(); g++) {
+				uint32_t geom = geoms[g];
+				uint32_t op = geom & 7;
+				uint32_t count = geom >> 3;
+
+				if (op == mvt_moveto || op == mvt_lineto) {
+					for (size_t k = 0; k < count && g + 2 < geoms.size(); k++) {
+						px += protozero::decode_zigzag32(geoms[g + 1]);
+						py += protozero::decode_zigzag32(geoms[g + 2]);
+						g += 2;
+
+						feature.geometry.push_back(mvt_geometry(op, px, py));
+					}
+				} else {
+					feature.geometry.push_back(mvt_geometry(op, 0, 0));
+				}
 			}
-			for (size_t i = 0; i < layer.values.size(); i++) {
-				layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+
+			layer.features.push_back(feature);
+			break;
+		}
+
+		default:
+			layer_reader.skip();
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < layer.keys.size(); i++) {
+		layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
+	}
+	for (size_t i = 0; i < layer.values.size(); i++) {
+		layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+	}
+}
+
+bool mvt_layer::decode(std::string const &message, bool geometry) {
+	decode_layer(protozero::pbf_reader(message), *this, geometry);
+	return true;
+}
+
+bool mvt_tile::decode(std::string &message, bool &was_compressed) {
+	return decode(message, was_compressed, false);
+}
+
+bool mvt_tile::decode(std::string &message, bool &was_compressed, bool raw) {
+	layers.clear();
+	std::string src;
+
+	if (is_compressed(message)) {
+		std::string uncompressed;
+		decompress(message, uncompressed);
+		src = uncompressed;
+		was_compressed = true;
+	} else {
+		src = message;
+		was_compressed = false;
+	}
+
+	protozero::pbf_reader reader(src);
+
+	while (reader.next()) {
+		switch (reader.tag()) {
+		case 3: /* layer */
+		{
+			mvt_layer layer;
+
+			if (raw) {
+				protozero::data_view view = reader.get_view();
+				layer.raw = std::string(view.data(), view.size());
+				decode_layer(protozero::pbf_reader(view), layer, false);
+			} else {
+				decode_layer(reader.get_message(), layer, true);
 			}
 
 			layers.push_back(layer);
@@ -271,6 +341,11 @@ std::string mvt_tile::encode() {
 	protozero::pbf_writer writer(data);
 
 	for (size_t i = 0; i < layers.size(); i++) {
+		if (layers[i].raw.size() != 0) {
+			writer.add_message(3, layers[i].raw);
+			continue;
+		}
+
 		std::string layer_string;
 		protozero::pbf_writer layer_writer(layer_string);
 
@@ -88,6 +88,13 @@ struct mvt_layer {
 	std::vector<mvt_value> values;
 	long long extent;
 
+	// If not empty, the layer as it was encoded, which mvt_tile::encode() copies
+	// instead of encoding the fields above
+	std::string raw;
+
+	// Decode a layer message, with or without the feature geometries
+	bool decode(std::string const &message, bool geometry);
+
 	// Add a key-value pair to a feature, using this layer's constant pool
 	void tag(mvt_feature &feature, std::string key, mvt_value value);
 
@@ -101,8 +108,13 @@ struct mvt_tile {
 
 	std::string encode();
 	bool decode(std::string &message, bool &was_compressed);
+
+	// With raw, keep each layer's message in its raw field and don't decode the geometries
+	bool decode(std::string &message, bool &was_compressed, bool raw);
 };
 
+extern int compression_level;
+
 bool is_compressed(std::string const &data);
 int decompress(std::string const &input, std::string &output);
 int compress(std::string const &input, std::string &output);
@@ -18,6 +18,10 @@
 #define A_GRID_LOW_ZOOMS ((int) 'L')
 #define A_DETECT_WRAPAROUND ((int) 'w')
 #define A_EXTEND_ZOOMS ((int) 'e')
+#define A_PREDICT_TILE_SIZES ((int) 'P')
+#define A_CLIP_TO_CHILD_TILES ((int) 'Q')
+#define A_VERTEX_IMPORTANCE ((int) 'I')
+#define A_POSTFILTER_MVT ((int) 'V')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
@@ -30,6 +34,7 @@
 #define P_DUPLICATION ((int) 'D')
 #define P_TINY_POLYGON_REDUCTION ((int) 't')
 #define P_TILE_COMPRESSION ((int) 'C')
+#define P_ZOOM_PIPELINING ((int) 'z')
 
 extern int prevent[256];
 extern int additional[256];
@@ -24,6 +24,9 @@
 #include "projection.hpp"
 #include "geometry.hpp"
 #include "serial.hpp"
+#include "threadpool.hpp"
+#include "options.hpp"
+#include "protozero/exception.hpp"
 
 extern "C" {
 #include "jsonpull/jsonpull.h"
@@ -33,8 +36,12 @@ extern "C" {
 #include "write_json.hpp"
 #include "read_json.hpp"
 
+int filter_processes = 0;
+
 struct writer_arg {
 	int write_to;
+	FILE *fp;
+	bool mvt;
 	std::vector<mvt_layer> *layers;
 	unsigned z;
 	unsigned x;
@@ -42,17 +49,144 @@ struct writer_arg {
 	int extent;
 };
 
+// Persistent filters see each tile's features bracketed by a TileStart
+// and a TileEnd object, and must copy the TileEnd to their output
+void filter_tile_start(FILE *fp, unsigned z, unsigned x, unsigned y) {
+	fprintf(fp, "{\"type\":\"TileStart\",\"zoom\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+}
+
+void filter_tile_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which) {
+	fprintf(fp, "{\"type\":\"TileEnd\",\"zoom\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+	filter_flush(fp, which);
+}
+
+void filter_flush(FILE *fp, const char *which) {
+	if (fflush(fp) != 0) {
+		if (errno == EPIPE) {
+			static bool warned = false;
+			if (!warned) {
+				fprintf(stderr, "Warning: broken pipe in %s\n", which);
+				warned = true;
+			}
+		} else {
+			perror("fflush output to filter");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// With --postfilter-mvt, each tile is exchanged with the filter as a 16-byte header
+// of four little-endian 32-bit integers (zoom, x, y, and length), followed by
+// that many bytes of uncompressed vector tile. The filter answers in the same form.
+
+#define MVT_FRAME_HEADER 16
+
+static void write_mvt_frame(FILE *fp, unsigned z, unsigned x, unsigned y, std::string const &tile) {
+	unsigned long long fields[4] = {z, x, y, tile.size()};
+	unsigned char header[MVT_FRAME_HEADER];
+
+	if (tile.size() > 0xFFFFFFFFULL) {
+		fprintf(stderr, "Tile %u/%u/%u is too large to send to the filter\n", z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < 4; i++) {
+		for (size_t j = 0; j < 4; j++) {
+			header[i * 4 + j] = (fields[i] >> (j * 8)) & 0xFF;
+		}
+	}
+
+	fwrite(header, sizeof(header), 1, fp);
+	fwrite(tile.c_str(), tile.size(), 1, fp);
+}
+
+// Returns the number of bytes read, which is less than n only at the end of the filter's output
+static size_t read_fully(int fd, char *buf, size_t n) {
+	size_t off = 0;
+
+	while (off < n) {
+		ssize_t nread = read(fd, buf + off, n - off);
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read from filter");
+			exit(EXIT_FAILURE);
+		}
+		if (nread == 0) {
+			break;
+		}
+		off += nread;
+	}
+
+	return off;
+}
+
+// Returns false if the filter closed its output without starting another tile
+static bool read_mvt_frame(int fd, unsigned z, unsigned x, unsigned y, std::string &tile) {
+	unsigned char header[MVT_FRAME_HEADER];
+	size_t n = read_fully(fd, (char *) header, sizeof(header));
+	if (n == 0) {
+		return false;
+	}
+	if (n < sizeof(header)) {
+		fprintf(stderr, "Filter output: incomplete tile header for tile %u/%u/%u\n", z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned long long fields[4];
+	for (size_t i = 0; i < 4; i++) {
+		fields[i] = 0;
+		for (size_t j = 0; j < 4; j++) {
+			fields[i] |= (unsigned long long) header[i * 4 + j] << (j * 8);
+		}
+	}
+
+	if (fields[0] != z || fields[1] != x || fields[2] != y) {
+		fprintf(stderr, "Filter output: got tile %llu/%llu/%llu while expecting tile %u/%u/%u\n", fields[0], fields[1], fields[2], z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
+	tile.resize(fields[3]);
+	if (read_fully(fd, &tile[0], tile.size()) < tile.size()) {
+		fprintf(stderr, "Filter output: tile %u/%u/%u is shorter than its header says\n", z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
+	return true;
+}
+
 void *run_writer(void *a) {
 	writer_arg *wa = (writer_arg *) a;
 
-	FILE *fp = fdopen(wa->write_to, "w");
+	FILE *fp = wa->fp;
 	if (fp == NULL) {
-		perror("fdopen (pipe writer)");
-		exit(EXIT_FAILURE);
+		fp = fdopen(wa->write_to, "w");
+		if (fp == NULL) {
+			perror("fdopen (pipe writer)");
+			exit(EXIT_FAILURE);
+		}
+	} else if (!wa->mvt) {
+		filter_tile_start(fp, wa->z, wa->x, wa->y);
 	}
 
-	for (size_t i = 0; i < wa->layers->size(); i++) {
-		layer_to_geojson(fp, (*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, 0, 0, 0, true);
+	if (wa->mvt) {
+		mvt_tile tile;
+		tile.layers = *(wa->layers);
+		write_mvt_frame(fp, wa->z, wa->x, wa->y, tile.encode());
+	} else {
+		for (size_t i = 0; i < wa->layers->size(); i++) {
+			layer_to_geojson(fp, (*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, 0, 0, 0, true);
+		}
+	}
+
+	if (wa->fp != NULL) {
+		if (wa->mvt) {
+			filter_flush(fp, "postfilter");
+		} else {
+			filter_tile_end(fp, wa->z, wa->x, wa->y, "postfilter");
+		}
+		return NULL;
 	}
 
 	if (fclose(fp) != 0) {
@@ -82,16 +216,66 @@ static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	return out;
 }
 
-// Reads from the postfilter
-std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	std::map<std::string, mvt_layer> ret;
+// Find or create the layermap entry for a layer that appears in the filter output
+static std::map<std::string, layermap_entry>::iterator filtered_layer(std::string const &layername, int z, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps) {
+	std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
+	if (layermap.count(layername) == 0) {
+		layermap_entry lme = layermap_entry(layermap.size());
+		lme.minzoom = z;
+		lme.maxzoom = z;
 
-	FILE *f = fdopen(fd, "r");
-	if (f == NULL) {
-		perror("fdopen filter output");
+		layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+
+		if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
+			(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
+			(*layer_unmaps)[tiling_seg][lme.id] = layername;
+		}
+	}
+
+	auto fk = layermap.find(layername);
+	if (fk == layermap.end()) {
+		fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
 		exit(EXIT_FAILURE);
 	}
-	json_pull *jp = json_begin_file(f);
+	if (z < fk->second.minzoom) {
+		fk->second.minzoom = z;
+	}
+	if (z > fk->second.maxzoom) {
+		fk->second.maxzoom = z;
+	}
+
+	return fk;
+}
+
+// Is this the delimiter that a persistent filter passed through at the end of the tile?
+static bool is_tile_end(json_pull *jp, json_object *j, json_object *type, unsigned z, unsigned x, unsigned y) {
+	if (filter_processes <= 0 || j->parent != NULL || strcmp(type->string, "TileEnd") != 0) {
+		return false;
+	}
+
+	json_object *zoom = json_hash_get(j, "zoom");
+	json_object *tx = json_hash_get(j, "x");
+	json_object *ty = json_hash_get(j, "y");
+	if (zoom == NULL || zoom->type != JSON_NUMBER || tx == NULL || tx->type != JSON_NUMBER || ty == NULL || ty->type != JSON_NUMBER ||
+	    zoom->number != z || tx->number != x || ty->number != y) {
+		fprintf(stderr, "Filter output:%d: TileEnd does not match tile %u/%u/%u\n", jp->line, z, x, y);
+		json_context(j);
+		exit(EXIT_FAILURE);
+	}
+
+	return true;
+}
+
+static void filter_eof(json_pull *jp, unsigned z, unsigned x, unsigned y) {
+	if (filter_processes > 0) {
+		fprintf(stderr, "Filter output:%d: filter exited before the end of tile %u/%u/%u\n", jp->line, z, x, y);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Reads from the postfilter until the end of its output or of the tile
+static std::vector<mvt_layer> read_layers(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::map<std::string, mvt_layer> ret;
 
 	while (1) {
 		json_object *j = json_read(jp);
@@ -104,6 +288,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				exit(EXIT_FAILURE);
 			}
 
+			filter_eof(jp, z, x, y);
 			json_free(jp->root);
 			break;
 		}
@@ -112,6 +297,10 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
 		}
+		if (is_tile_end(jp, j, type, z, x, y)) {
+			json_free(j);
+			break;
+		}
 		if (strcmp(type->string, "Feature") != 0) {
 			continue;
 		}
@@ -219,31 +408,7 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 				feature.has_id = true;
 			}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
-
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
-
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
-
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_FAILURE);
-			}
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
+			auto fk = filtered_layer(layername, z, layermaps, tiling_seg, layer_unmaps);
 
 			if (feature.type == mvt_point) {
 				fk->second.points++;
@@ -277,19 +442,127 @@ std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::
 		json_free(j);
 	}
 
+	std::vector<mvt_layer> final;
+	for (auto a : ret) {
+		final.push_back(a.second);
+	}
+	return final;
+}
+
+// Reads from the postfilter
+std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	FILE *f = fdopen(fd, "r");
+	if (f == NULL) {
+		perror("fdopen filter output");
+		exit(EXIT_FAILURE);
+	}
+	json_pull *jp = json_begin_file(f);
+
+	std::vector<mvt_layer> final = read_layers(jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+
 	json_end(jp);
 	if (fclose(f) != 0) {
 		perror("fclose postfilter output");
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<mvt_layer> final;
-	for (auto a : ret) {
-		final.push_back(a.second);
-	}
 	return final;
 }
 
+// Reads a binary tile from the postfilter
+static std::vector<mvt_layer> read_mvt_layers(int fd, bool persistent, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::string message;
+	if (!read_mvt_frame(fd, z, x, y, message)) {
+		if (persistent) {
+			fprintf(stderr, "Filter output: filter exited before the end of tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+		return std::vector<mvt_layer>();
+	}
+
+	mvt_tile tile;
+	bool was_compressed;
+	try {
+		if (!tile.decode(message, was_compressed)) {
+			fprintf(stderr, "Filter output: couldn't parse tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+	} catch (protozero::exception const &e) {
+		fprintf(stderr, "Filter output: PBF decoding error in tile %d/%u/%u: %s\n", z, x, y, e.what());
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t l = 0; l < tile.layers.size(); l++) {
+		mvt_layer &layer = tile.layers[l];
+		auto fk = filtered_layer(layer.name, z, layermaps, tiling_seg, layer_unmaps);
+
+		if (layer.extent <= 0) {
+			fprintf(stderr, "Filter output: layer %s has invalid extent %lld in tile %d/%u/%u\n", layer.name.c_str(), (long long) layer.extent, z, x, y);
+			exit(EXIT_FAILURE);
+		}
+
+		if (layer.extent != extent) {
+			for (size_t f = 0; f < layer.features.size(); f++) {
+				std::vector<mvt_geometry> &geom = layer.features[f].geometry;
+				for (size_t i = 0; i < geom.size(); i++) {
+					geom[i].x = std::round(geom[i].x * (double) extent / layer.extent);
+					geom[i].y = std::round(geom[i].y * (double) extent / layer.extent);
+				}
+			}
+			layer.extent = extent;
+		}
+
+		for (size_t f = 0; f < layer.features.size(); f++) {
+			mvt_feature &feature = layer.features[f];
+
+			if (feature.type == mvt_point) {
+				fk->second.points++;
+			} else if (feature.type == mvt_linestring) {
+				fk->second.lines++;
+			} else if (feature.type == mvt_polygon) {
+				fk->second.polygons++;
+			}
+
+			for (size_t t = 0; t + 1 < feature.tags.size(); t += 2) {
+				if (feature.tags[t] >= layer.keys.size() || feature.tags[t + 1] >= layer.values.size()) {
+					fprintf(stderr, "Filter output: attribute out of range in tile %d/%u/%u\n", z, x, y);
+					exit(EXIT_FAILURE);
+				}
+
+				mvt_value const &val = layer.values[feature.tags[t + 1]];
+				type_and_string attrib;
+
+				if (val.type == mvt_string) {
+					attrib.type = mvt_string;
+					attrib.string = val.string_value;
+				} else if (val.type == mvt_bool) {
+					attrib.type = mvt_bool;
+					attrib.string = val.numeric_value.bool_value ? "true" : "false";
+				} else {
+					attrib.type = mvt_double;
+					if (val.type == mvt_int) {
+						aprintf(&attrib.string, "%lld", (long long) val.numeric_value.int_value);
+					} else if (val.type == mvt_sint) {
+						aprintf(&attrib.string, "%lld", (long long) val.numeric_value.sint_value);
+					} else if (val.type == mvt_uint) {
+						aprintf(&attrib.string, "%llu", (unsigned long long) val.numeric_value.uint_value);
+					} else if (val.type == mvt_float) {
+						aprintf(&attrib.string, "%g", val.numeric_value.float_value);
+					} else if (val.type == mvt_double) {
+						aprintf(&attrib.string, "%g", val.numeric_value.double_value);
+					} else {
+						continue;
+					}
+				}
+
+				add_to_file_keys(fk->second.file_keys, layer.keys[feature.tags[t]], attrib);
+			}
+		}
+	}
+
+	return tile.layers;
+}
+
 // Reads from the prefilter
 serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
 	serial_feature sf;
@@ -305,6 +578,7 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				exit(EXIT_FAILURE);
 			}
 
+			filter_eof(jp, z, x, y);
 			json_free(jp->root);
 			sf.t = -1;
 			return sf;
@@ -314,6 +588,11 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
 		}
+		if (is_tile_end(jp, j, type, z, x, y)) {
+			json_free(j);
+			sf.t = -1;
+			return sf;
+		}
 		if (strcmp(type->string, "Feature") != 0) {
 			continue;
 		}
@@ -444,35 +723,9 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				sf.has_id = true;
 			}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
-
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
-
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
-
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_FAILURE);
-			}
+			auto fk = filtered_layer(layername, z, layermaps, tiling_seg, layer_unmaps);
 			sf.layer = fk->second.id;
 
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
-
 			if (!postfilter) {
 				if (sf.t == mvt_point) {
 					fk->second.points++;
@@ -514,12 +767,17 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 
 static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
-	// This will create two pipes, a new thread, and a new process.
-	//
-	// The new process will read from one pipe and write to the other, and execute the filter.
-	// The new thread will write the GeoJSON to the pipe that leads to the filter.
-	// The original thread will read the GeoJSON from the filter and convert it back into vector tiles.
+static void start_filter(const char *filter, std::vector<std::string> const &args, int *write_to, int *read_from, pid_t *pid) {
+	// Build the argument list before forking, since the child may not allocate
+	std::vector<const char *> argv;
+	argv.push_back("sh");
+	argv.push_back("-c");
+	argv.push_back(filter);
+	argv.push_back("sh");
+	for (size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+	}
+	argv.push_back(NULL);
 
 	if (pthread_mutex_lock(&pipe_lock) != 0) {
 		perror("pthread_mutex_lock (pipe)");
@@ -536,10 +794,6 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 		exit(EXIT_FAILURE);
 	}
 
-	std::string z_str = std::to_string(z);
-	std::string x_str = std::to_string(x);
-	std::string y_str = std::to_string(y);
-
 	*pid = fork();
 	if (*pid < 0) {
 		perror("fork");
@@ -574,7 +828,7 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 
 		// XXX close other fds?
 
-		if (execlp("sh", "sh", "-c", filter, "sh", z_str.c_str(), x_str.c_str(), y_str.c_str(), NULL) != 0) {
+		if (execvp("sh", (char *const *) argv.data()) != 0) {
 			perror("exec");
 			exit(EXIT_FAILURE);
 		}
@@ -608,26 +862,217 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 	}
 }
 
+void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+	// This will create two pipes, a new thread, and a new process.
+	//
+	// The new process will read from one pipe and write to the other, and execute the filter.
+	// The new thread will write the GeoJSON to the pipe that leads to the filter.
+	// The original thread will read the GeoJSON from the filter and convert it back into vector tiles.
+
+	std::vector<std::string> args;
+	args.push_back(std::to_string(z));
+	args.push_back(std::to_string(x));
+	args.push_back(std::to_string(y));
+
+	start_filter(filter, args, write_to, read_from, pid);
+}
+
+// Persistent filter processes, started as they are first needed,
+// up to filter_processes of them for each filter command.
+// Each one is lent to a single tile at a time.
+
+static pthread_mutex_t filter_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filter_pool_cond = PTHREAD_COND_INITIALIZER;
+static std::map<std::pair<std::string, bool>, std::vector<filter_process *>> filter_pool;
+
+// jsonpull's file reader waits for a full buffer, which would never
+// arrive from a filter that is waiting for the next tile
+static ssize_t read_filter(json_pull *jp, char *buffer, size_t n) {
+	filter_process *p = (filter_process *) jp->source;
+
+	while (1) {
+		ssize_t nread = read(p->read_from, buffer, n);
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read from filter");
+			exit(EXIT_FAILURE);
+		}
+		return nread;
+	}
+}
+
+// Processes that speak the binary tile protocol are kept apart from those that speak GeoJSON
+filter_process *acquire_filter(const char *filter, bool mvt) {
+	if (pthread_mutex_lock(&filter_pool_lock) != 0) {
+		perror("pthread_mutex_lock (filter pool)");
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<filter_process *> &pool = filter_pool[std::pair<std::string, bool>(filter, mvt)];
+	filter_process *p = NULL;
+
+	while (p == NULL) {
+		for (size_t i = 0; i < pool.size(); i++) {
+			if (!pool[i]->busy) {
+				p = pool[i];
+				break;
+			}
+		}
+
+		if (p == NULL && pool.size() < (size_t) filter_processes) {
+			p = new filter_process;
+
+			int write_to;
+			start_filter(filter, std::vector<std::string>(), &write_to, &p->read_from, &p->pid);
+
+			p->to = fdopen(write_to, "w");
+			if (p->to == NULL) {
+				perror("fdopen output to filter");
+				exit(EXIT_FAILURE);
+			}
+			p->jp = json_begin(read_filter, p);
+
+			pool.push_back(p);
+		}
+
+		if (p == NULL) {
+			if (pthread_cond_wait(&filter_pool_cond, &filter_pool_lock) != 0) {
+				perror("pthread_cond_wait (filter pool)");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	p->busy = true;
+
+	if (pthread_mutex_unlock(&filter_pool_lock) != 0) {
+		perror("pthread_mutex_unlock (filter pool)");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+void release_filter(filter_process *p) {
+	if (pthread_mutex_lock(&filter_pool_lock) != 0) {
+		perror("pthread_mutex_lock (filter pool)");
+		exit(EXIT_FAILURE);
+	}
+
+	p->busy = false;
+
+	if (pthread_cond_broadcast(&filter_pool_cond) != 0) {
+		perror("pthread_cond_broadcast (filter pool)");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_unlock(&filter_pool_lock) != 0) {
+		perror("pthread_mutex_unlock (filter pool)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Close the input of every persistent filter and wait for it to exit
+void finish_filters() {
+	for (auto &pool : filter_pool) {
+		for (size_t i = 0; i < pool.second.size(); i++) {
+			filter_process *p = pool.second[i];
+
+			if (fclose(p->to) != 0 && errno != EPIPE) {
+				perror("fclose output to filter");
+				exit(EXIT_FAILURE);
+			}
+
+			// Discard anything the filter writes after its last tile
+			char buf[2000];
+			while (read_fully(p->read_from, buf, sizeof(buf)) == sizeof(buf)) {
+				continue;
+			}
+			json_end(p->jp);
+
+			if (close(p->read_from) != 0) {
+				perror("close input from filter");
+				exit(EXIT_FAILURE);
+			}
+
+			while (1) {
+				int stat_loc;
+				if (waitpid(p->pid, &stat_loc, 0) < 0) {
+					perror("waitpid for filter\n");
+					exit(EXIT_FAILURE);
+				}
+				if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+					break;
+				}
+			}
+
+			delete p;
+		}
+	}
+
+	filter_pool.clear();
+}
+
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	bool mvt = additional[A_POSTFILTER_MVT];
+
+	if (filter_processes > 0) {
+		filter_process *p = acquire_filter(filter, mvt);
+
+		writer_arg wa;
+		wa.write_to = -1;
+		wa.fp = p->to;
+		wa.mvt = mvt;
+		wa.layers = &layers;
+		wa.z = z;
+		wa.x = x;
+		wa.y = y;
+		wa.extent = extent;
+
+		job writer;
+		threadpool_start(&writer, run_writer, &wa);
+
+		std::vector<mvt_layer> nlayers;
+		if (mvt) {
+			nlayers = read_mvt_layers(p->read_from, true, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+		} else {
+			nlayers = read_layers(p->jp, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+		}
+
+		threadpool_join(&writer);
+		release_filter(p);
+
+		return nlayers;
+	}
+
 	int write_to, read_from;
 	pid_t pid;
 	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
 
 	writer_arg wa;
 	wa.write_to = write_to;
+	wa.fp = NULL;
+	wa.mvt = mvt;
 	wa.layers = &layers;
 	wa.z = z;
 	wa.x = x;
 	wa.y = y;
 	wa.extent = extent;
 
-	pthread_t writer;
-	if (pthread_create(&writer, NULL, run_writer, &wa) != 0) {
-		perror("pthread_create (filter writer)");
-		exit(EXIT_FAILURE);
-	}
+	job writer;
+	threadpool_start(&writer, run_writer, &wa);
 
-	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	std::vector<mvt_layer> nlayers;
+	if (mvt) {
+		nlayers = read_mvt_layers(read_from, false, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+		if (close(read_from) != 0) {
+			perror("close postfilter output");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	}
 
 	while (1) {
 		int stat_loc;
@@ -640,11 +1085,7 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		}
 	}
 
-	void *ret;
-	if (pthread_join(writer, &ret) != 0) {
-		perror("pthread_join filter writer");
-		exit(EXIT_FAILURE);
-	}
+	threadpool_join(&writer);
 
 	return nlayers;
 }
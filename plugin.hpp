@@ -1,3 +1,20 @@
+extern int filter_processes;
+
+struct filter_process {
+	pid_t pid = 0;
+	FILE *to = NULL;
+	int read_from = -1;
+	json_pull *jp = NULL;
+	bool busy = false;
+};
+
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
 void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y);
 serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters);
+
+filter_process *acquire_filter(const char *filter, bool mvt);
+void release_filter(filter_process *p);
+void finish_filters();
+void filter_tile_start(FILE *fp, unsigned z, unsigned x, unsigned y);
+void filter_tile_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which);
+void filter_flush(FILE *fp, const char *which);
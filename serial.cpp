@@ -2,16 +2,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <string>
 #include <vector>
 #include <sqlite3.h>
 #include <set>
 #include <map>
+#include <algorithm>
 #include "protozero/varint.hpp"
 #include "geometry.hpp"
 #include "mbtiles.hpp"
 #include "tile.hpp"
 #include "serial.hpp"
+#include "main.hpp"
+#include "options.hpp"
 
 size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, const char *fname) {
 	size_t w = fwrite(ptr, size, nitems, stream);
@@ -166,6 +170,9 @@ static void write_geometry(drawvec const &dv, long long *fpos, FILE *out, const
 			serialize_byte(out, dv[i].op, fpos, fname);
 			serialize_long_long(out, dv[i].x - wx, fpos, fname);
 			serialize_long_long(out, dv[i].y - wy, fpos, fname);
+			if (additional[A_VERTEX_IMPORTANCE]) {
+				serialize_ulong_long(out, dv[i].importance, fpos, fname);
+			}
 			wx = dv[i].x;
 			wy = dv[i].y;
 		} else {
@@ -174,11 +181,50 @@ static void write_geometry(drawvec const &dv, long long *fpos, FILE *out, const
 	}
 }
 
+static size_t varint_size(unsigned long long n) {
+	size_t size = 1;
+	while (n >= 0x80) {
+		n >>= 7;
+		size++;
+	}
+	return size;
+}
+
+// The number of bytes that write_geometry() and the VT_END after it will write,
+// and the bounding box of the geometry
+static long long geometry_size(drawvec const &dv, long long wx, long long wy, long long *bbox) {
+	long long size = 1;
+
+	bbox[0] = bbox[1] = LLONG_MAX;
+	bbox[2] = bbox[3] = LLONG_MIN;
+
+	for (size_t i = 0; i < dv.size(); i++) {
+		size++;
+		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
+			size += varint_size(protozero::encode_zigzag64(dv[i].x - wx));
+			size += varint_size(protozero::encode_zigzag64(dv[i].y - wy));
+			if (additional[A_VERTEX_IMPORTANCE]) {
+				size += varint_size(dv[i].importance);
+			}
+			wx = dv[i].x;
+			wy = dv[i].y;
+
+			bbox[0] = std::min(bbox[0], wx);
+			bbox[1] = std::min(bbox[1], wy);
+			bbox[2] = std::max(bbox[2], wx);
+			bbox[3] = std::max(bbox[3], wy);
+		}
+	}
+
+	return size;
+}
+
 void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, const char *fname, long long wx, long long wy, bool include_minzoom) {
 	serialize_byte(geomfile, sf->t, geompos, fname);
 
 	long long layer = 0;
-	layer |= sf->layer << 6;
+	layer |= sf->layer << 7;
+	layer |= sf->full << 6;
 	layer |= (sf->seq != 0) << 5;
 	layer |= (sf->index != 0) << 4;
 	layer |= (sf->extent != 0) << 3;
@@ -202,7 +248,24 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, c
 
 	serialize_int(geomfile, sf->segment, geompos, fname);
 
-	write_geometry(sf->geometry, geompos, geomfile, fname, wx, wy);
+	// The bounding box and the size of the geometry come first, so that a feature
+	// that doesn't touch the tile being read can be skipped without decoding it.
+	// A geometry with no points is written as empty, and has no bounding box.
+	long long bbox[4];
+	long long size = geometry_size(sf->geometry, wx, wy, bbox);
+	bool empty = bbox[0] > bbox[2];
+	if (empty) {
+		size = 1;
+	}
+	serialize_long_long(geomfile, size, geompos, fname);
+	if (!empty) {
+		serialize_long_long(geomfile, bbox[0] - wx, geompos, fname);
+		serialize_long_long(geomfile, bbox[1] - wy, geompos, fname);
+		serialize_long_long(geomfile, bbox[2] - bbox[0], geompos, fname);
+		serialize_long_long(geomfile, bbox[3] - bbox[1], geompos, fname);
+
+		write_geometry(sf->geometry, geompos, geomfile, fname, wx, wy);
+	}
 	serialize_byte(geomfile, VT_END, geompos, fname);
 	if (sf->index != 0) {
 		serialize_ulong_long(geomfile, sf->index, geompos, fname);
@@ -231,7 +294,7 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, c
 	}
 }
 
-serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
+serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long buffer) {
 	serial_feature sf;
 
 	deserialize_byte_io(geoms, &sf.t, geompos_in);
@@ -266,7 +329,48 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 	sf.index = 0;
 	sf.extent = 0;
 
-	sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	long long size;
+	deserialize_long_long_io(geoms, &size, geompos_in);
+
+	bool skip = false;
+	if (size > 1) {
+		long long bbox[4];
+		for (size_t i = 0; i < 4; i++) {
+			deserialize_long_long_io(geoms, &bbox[i], geompos_in);
+		}
+
+		// Same arithmetic as decode_geometry()
+		sf.bbox[0] = initial_x[sf.segment] + bbox[0] * (1 << geometry_scale);
+		sf.bbox[1] = initial_y[sf.segment] + bbox[1] * (1 << geometry_scale);
+		sf.bbox[2] = sf.bbox[0] + bbox[2] * (1 << geometry_scale);
+		sf.bbox[3] = sf.bbox[1] + bbox[3] * (1 << geometry_scale);
+		if (z != 0) {
+			sf.bbox[0] -= tx << (32 - z);
+			sf.bbox[1] -= ty << (32 - z);
+			sf.bbox[2] -= tx << (32 - z);
+			sf.bbox[3] -= ty << (32 - z);
+		}
+
+		skip = quick_check(sf.bbox, z, buffer) == 0;
+	}
+
+	if (skip) {
+		// The caller will find from the bounding box that the feature is outside the tile
+		if (fseek(geoms, size, SEEK_CUR) != 0) {
+			perror("fseek geometry");
+			exit(EXIT_FAILURE);
+		}
+		*geompos_in += size;
+	} else {
+		long long bbox[4];
+		sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, size > 1 ? bbox : sf.bbox, initial_x[sf.segment], initial_y[sf.segment], additional[A_VERTEX_IMPORTANCE]);
+	}
+	if (sf.layer & (1 << 6)) {
+		// The geometry will be filled in for the tile's buffer when it is clipped
+		sf.full = true;
+		sf.bbox[0] = sf.bbox[1] = 0;
+		sf.bbox[2] = sf.bbox[3] = 1LL << (32 - z);
+	}
 	if (sf.layer & (1 << 4)) {
 		deserialize_ulong_long_io(geoms, &sf.index, geompos_in);
 	}
@@ -274,7 +378,7 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 		deserialize_long_long_io(geoms, &sf.extent, geompos_in);
 	}
 
-	sf.layer >>= 6;
+	sf.layer >>= 7;
 
 	sf.metapos = 0;
 	{
@@ -286,6 +390,9 @@ serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *met
 		deserialize_long_long_io(geoms, &sf.metapos, geompos_in);
 	}
 
+	sf.keys.reserve(sf.m);
+	sf.values.reserve(sf.m);
+
 	if (sf.metapos >= 0) {
 		char *meta = metabase + sf.metapos + meta_off[sf.segment];
 
@@ -50,6 +50,7 @@ struct serial_feature {
 	int tippecanoe_maxzoom;
 
 	drawvec geometry;
+	bool full = false;  // polygon that covers the whole tile; geometry is not serialized
 	unsigned long long index;
 	long long extent;
 
@@ -65,6 +66,6 @@ struct serial_feature {
 };
 
 void serialize_feature(FILE *geomfile, serial_feature *sf, long long *geompos, const char *fname, long long wx, long long wy, bool include_minzoom);
-serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+serial_feature deserialize_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long buffer);
 
 #endif
@@ -0,0 +1,107 @@
+// Times line simplification on long, coastline-like linestrings and on many small rings,
+// for comparing builds of geometry.cpp. Run with "make bench". The checksum of the
+// simplified output should be the same from one build to the next.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "geometry.hpp"
+#include "options.hpp"
+
+int geometry_scale = 0;
+int prevent[256];
+int additional[256];
+
+static unsigned long long bench_seed = 1;
+
+static long long bench_random(long long range) {
+	bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (long long) ((bench_seed >> 33) % (unsigned long long) range);
+}
+
+// A random walk with mostly small steps and occasional large ones,
+// which is about how a detailed coastline looks to the simplifier
+static drawvec coastline(size_t vertices) {
+	drawvec dv;
+	long long x = (1LL << 31) + bench_random(1LL << 24);
+	long long y = (1LL << 31) + bench_random(1LL << 24);
+
+	for (size_t i = 0; i < vertices; i++) {
+		long long step = bench_random(100) == 0 ? 1 << 16 : 1 << 10;
+		x += bench_random(2 * step + 1) - step;
+		y += bench_random(2 * step + 1) - step;
+		dv.push_back(draw(i == 0 ? VT_MOVETO : VT_LINETO, x, y));
+	}
+
+	return dv;
+}
+
+static drawvec small_rings(size_t rings, size_t vertices) {
+	drawvec dv;
+
+	for (size_t r = 0; r < rings; r++) {
+		long long x = bench_random(1LL << 32);
+		long long y = bench_random(1LL << 32);
+
+		for (size_t i = 0; i < vertices; i++) {
+			dv.push_back(draw(i == 0 ? VT_MOVETO : VT_LINETO, x + bench_random(1 << 12), y + bench_random(1 << 12)));
+		}
+		dv.push_back(draw(VT_LINETO, x, y));
+	}
+
+	return dv;
+}
+
+static unsigned long long checksum(drawvec const &dv, unsigned long long sum) {
+	for (size_t i = 0; i < dv.size(); i++) {
+		sum = sum * 31 + dv[i].x;
+		sum = sum * 31 + dv[i].y;
+	}
+	return sum;
+}
+
+static void run(const char *name, std::vector<drawvec> const &geoms, bool use_importance) {
+	unsigned long long sum = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int z = 0; z <= 14; z++) {
+		for (size_t i = 0; i < geoms.size(); i++) {
+			drawvec geom = geoms[i];
+			drawvec out = simplify_lines(geom, z, 12, false, 1, 0, use_importance);
+			sum = checksum(out, sum);
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%-40s %8.3fs  checksum %016llx\n", name, elapsed, sum);
+}
+
+int main() {
+	std::vector<drawvec> coastlines;
+	for (size_t i = 0; i < 20; i++) {
+		coastlines.push_back(coastline(100000));
+	}
+
+	std::vector<drawvec> rings;
+	for (size_t i = 0; i < 2000; i++) {
+		rings.push_back(small_rings(100, 6));
+	}
+
+	run("coastlines, 20 x 100000 vertices", coastlines, false);
+	run("small rings, 200000 x 7 vertices", rings, false);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < coastlines.size(); i++) {
+		compute_importance(coastlines[i], 0);
+	}
+	for (size_t i = 0; i < rings.size(); i++) {
+		compute_importance(rings[i], 0);
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%-40s %8.3fs\n", "compute_importance(), all of the above", elapsed);
+
+	run("coastlines, by importance", coastlines, true);
+	run("small rings, by importance", rings, true);
+
+	return 0;
+}
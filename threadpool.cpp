@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <deque>
+#include "threadpool.hpp"
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+static pthread_mutex_t threadpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threadpool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t threadpool_done = PTHREAD_COND_INITIALIZER;
+static std::deque<job *> threadpool_queue;
+static size_t threadpool_idle = 0;
+
+static void lock() {
+	if (pthread_mutex_lock(&threadpool_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock() {
+	if (pthread_mutex_unlock(&threadpool_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Must be called with the lock held, and returns with it held
+static void run_job(job *j) {
+	j->state = JOB_RUNNING;
+	unlock();
+
+	void *retval = j->func(j->arg);
+
+	lock();
+	j->retval = retval;
+	j->state = JOB_DONE;
+	pthread_cond_broadcast(&threadpool_done);
+}
+
+static void *threadpool_worker(void *) {
+	lock();
+
+	while (true) {
+		while (threadpool_queue.size() == 0) {
+			threadpool_idle++;
+			pthread_cond_wait(&threadpool_work, &threadpool_lock);
+			threadpool_idle--;
+		}
+
+		job *j = threadpool_queue.front();
+		threadpool_queue.pop_front();
+		run_job(j);
+	}
+
+	return NULL;
+}
+
+void threadpool_start(job *j, void *(*func)(void *), void *arg) {
+	j->func = func;
+	j->arg = arg;
+	j->retval = NULL;
+	j->state = JOB_QUEUED;
+
+	lock();
+	threadpool_queue.push_back(j);
+
+	// Jobs may wait for each other, so there must be a thread for each of them.
+	// The pool only grows when all of the existing threads are busy.
+	if (threadpool_idle >= threadpool_queue.size()) {
+		pthread_cond_signal(&threadpool_work);
+	} else {
+		pthread_attr_t attr;
+		pthread_t thread;
+
+		if (pthread_attr_init(&attr) != 0 || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
+			perror("pthread_attr");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_create(&thread, &attr, threadpool_worker, NULL) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	unlock();
+}
+
+void *threadpool_join(job *j) {
+	lock();
+
+	if (j->state == JOB_QUEUED) {
+		for (size_t i = 0; i < threadpool_queue.size(); i++) {
+			if (threadpool_queue[i] == j) {
+				threadpool_queue.erase(threadpool_queue.begin() + i);
+				break;
+			}
+		}
+
+		run_job(j);
+	}
+
+	while (j->state != JOB_DONE) {
+		pthread_cond_wait(&threadpool_done, &threadpool_lock);
+	}
+
+	void *retval = j->retval;
+	unlock();
+	return retval;
+}
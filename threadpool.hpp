@@ -0,0 +1,23 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+// A job runs on one of a process-wide set of worker threads that are
+// created as they are first needed and then kept for reuse, so that
+// starting a job doesn't cost a pthread_create().
+
+struct job {
+	void *(*func)(void *);
+	void *arg;
+	void *retval;
+	int state;
+};
+
+// Like pthread_create(): run func(arg) on a pool thread.
+// Jobs always start promptly, so they may wait for each other.
+void threadpool_start(struct job *j, void *(*func)(void *), void *arg);
+
+// Like pthread_join(): wait for the job to finish and return what func returned.
+// A job that no thread has picked up yet is run on the calling thread instead.
+void *threadpool_join(struct job *j);
+
+#endif
@@ -13,6 +13,7 @@
 #include <string>
 #include <map>
 #include <set>
+#include <deque>
 #include <zlib.h>
 #include <math.h>
 #include <pthread.h>
@@ -22,14 +23,13 @@
 #include "mbtiles.hpp"
 #include "geometry.hpp"
 #include "dirtiles.hpp"
+#include "csv.hpp"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <functional>
 #include "jsonpull/jsonpull.h"
 
-std::string dequote(std::string s);
-
 int pk = false;
 int pC = false;
 size_t CPUS;
@@ -42,217 +42,270 @@ struct stats {
 	double minlat, minlon, maxlat, maxlon;
 };
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile) {
-	mvt_tile tile;
-	int features_added = 0;
+// The string and tilestats type that represent an attribute value,
+// or false if it is of a type that can't be represented
+static bool stringify_value(mvt_value const &val, std::string &value, int &type) {
+	if (val.type == mvt_string) {
+		value = val.string_value;
+		type = mvt_string;
+	} else if (val.type == mvt_int) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
+		type = mvt_double;
+	} else if (val.type == mvt_double) {
+		aprintf(&value, "%g", val.numeric_value.double_value);
+		type = mvt_double;
+	} else if (val.type == mvt_float) {
+		aprintf(&value, "%g", val.numeric_value.float_value);
+		type = mvt_double;
+	} else if (val.type == mvt_bool) {
+		aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
+		type = mvt_bool;
+	} else if (val.type == mvt_sint) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
+		type = mvt_double;
+	} else if (val.type == mvt_uint) {
+		aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
+		type = mvt_double;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Decode a tile's layers as raw messages, with their attributes but not their geometry
+void decode_tile(std::string &message, int z, unsigned x, unsigned y, mvt_tile &tile) {
 	bool was_compressed;
 
-	if (!tile.decode(message, was_compressed)) {
+	if (!tile.decode(message, was_compressed, true)) {
 		fprintf(stderr, "Couldn't decompress tile %d/%u/%u\n", z, x, y);
 		exit(EXIT_FAILURE);
 	}
+}
 
-	for (size_t l = 0; l < tile.layers.size(); l++) {
-		mvt_layer &layer = tile.layers[l];
-
-		if (keep_layers.size() > 0 && keep_layers.count(layer.name) == 0) {
-			continue;
-		}
-		if (remove_layers.count(layer.name) != 0) {
-			continue;
+// Join the features of one decoded layer into the layer of the same name in outtile
+void handle(mvt_layer &layer, int z, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, csv_table const *joins, std::set<std::string> &exclude, int ifmatched, mvt_tile &outtile) {
+	size_t ol;
+	for (ol = 0; ol < outtile.layers.size(); ol++) {
+		if (layer.name == outtile.layers[ol].name) {
+			break;
 		}
+	}
 
-		size_t ol;
-		for (ol = 0; ol < outtile.layers.size(); ol++) {
-			if (tile.layers[l].name == outtile.layers[ol].name) {
-				break;
-			}
-		}
+	if (ol == outtile.layers.size()) {
+		outtile.layers.push_back(mvt_layer());
+
+		outtile.layers[ol].name = layer.name;
+		outtile.layers[ol].version = layer.version;
+		outtile.layers[ol].extent = layer.extent;
+	}
+
+	mvt_layer &outlayer = outtile.layers[ol];
 
-		if (ol == outtile.layers.size()) {
-			outtile.layers.push_back(mvt_layer());
+	if (layer.extent != outlayer.extent) {
+		if (layer.extent > outlayer.extent) {
+			for (size_t i = 0; i < outlayer.features.size(); i++) {
+				for (size_t j = 0; j < outlayer.features[i].geometry.size(); j++) {
+					outlayer.features[i].geometry[j].x = outlayer.features[i].geometry[j].x * layer.extent / outlayer.extent;
+					outlayer.features[i].geometry[j].y = outlayer.features[i].geometry[j].y * layer.extent / outlayer.extent;
+				}
+			}
 
-			outtile.layers[ol].name = layer.name;
-			outtile.layers[ol].version = layer.version;
-			outtile.layers[ol].extent = layer.extent;
+			outlayer.extent = layer.extent;
 		}
+	}
 
-		mvt_layer &outlayer = outtile.layers[ol];
+	auto file_keys = layermap.find(layer.name);
 
-		if (layer.extent != outlayer.extent) {
-			if (layer.extent > outlayer.extent) {
-				for (size_t i = 0; i < outlayer.features.size(); i++) {
-					for (size_t j = 0; j < outlayer.features[i].geometry.size(); j++) {
-						outlayer.features[i].geometry[j].x = outlayer.features[i].geometry[j].x * layer.extent / outlayer.extent;
-						outlayer.features[i].geometry[j].y = outlayer.features[i].geometry[j].y * layer.extent / outlayer.extent;
-					}
-				}
+	for (size_t f = 0; f < layer.features.size(); f++) {
+		mvt_feature feat = layer.features[f];
+		mvt_feature outfeature;
+		int matched = 0;
 
-				outlayer.extent = layer.extent;
-			}
+		if (feat.has_id) {
+			outfeature.has_id = true;
+			outfeature.id = feat.id;
 		}
 
-		auto file_keys = layermap.find(layer.name);
+		std::map<std::string, std::pair<mvt_value, type_and_string>> attributes;
+		std::vector<std::string> key_order;
 
-		for (size_t f = 0; f < layer.features.size(); f++) {
-			mvt_feature feat = layer.features[f];
-			mvt_feature outfeature;
-			int matched = 0;
+		for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+			const char *key = layer.keys[feat.tags[t]].c_str();
+			mvt_value &val = layer.values[feat.tags[t + 1]];
+			std::string value;
+			int type = -1;
 
-			if (feat.has_id) {
-				outfeature.has_id = true;
-				outfeature.id = feat.id;
+			if (!stringify_value(val, value, type)) {
+				continue;
 			}
 
-			std::map<std::string, std::pair<mvt_value, type_and_string>> attributes;
-			std::vector<std::string> key_order;
-
-			for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-				const char *key = layer.keys[feat.tags[t]].c_str();
-				mvt_value &val = layer.values[feat.tags[t + 1]];
-				std::string value;
-				int type = -1;
-
-				if (val.type == mvt_string) {
-					value = val.string_value;
-					type = mvt_string;
-				} else if (val.type == mvt_int) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
-					type = mvt_double;
-				} else if (val.type == mvt_double) {
-					aprintf(&value, "%g", val.numeric_value.double_value);
-					type = mvt_double;
-				} else if (val.type == mvt_float) {
-					aprintf(&value, "%g", val.numeric_value.float_value);
-					type = mvt_double;
-				} else if (val.type == mvt_bool) {
-					aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
-					type = mvt_bool;
-				} else if (val.type == mvt_sint) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
-					type = mvt_double;
-				} else if (val.type == mvt_uint) {
-					aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
-					type = mvt_double;
-				} else {
-					continue;
-				}
+			if (exclude.count(std::string(key)) == 0) {
+				type_and_string tas;
+				tas.type = type;
+				tas.string = value;
 
-				if (type < 0) {
-					continue;
-				}
+				attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(key, std::pair<mvt_value, type_and_string>(val, tas)));
+				key_order.push_back(key);
+			}
 
-				if (exclude.count(std::string(key)) == 0) {
-					type_and_string tas;
-					tas.type = type;
-					tas.string = value;
+			if (header.size() > 0 && strcmp(key, header[0].c_str()) == 0) {
+				std::vector<std::string> fields;
 
-					attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(key, std::pair<mvt_value, type_and_string>(val, tas)));
-					key_order.push_back(key);
-				}
+				if (joins->find(value, fields)) {
+					matched = 1;
 
-				if (header.size() > 0 && strcmp(key, header[0].c_str()) == 0) {
-					std::map<std::string, std::vector<std::string>>::iterator ii = mapping.find(value);
+					for (size_t i = 1; i < fields.size(); i++) {
+						std::string joinkey = header[i];
+						std::string joinval = fields[i];
+						int attr_type = mvt_string;
 
-					if (ii != mapping.end()) {
-						std::vector<std::string> fields = ii->second;
-						matched = 1;
+						if (joinval.size() > 0) {
+							if (joinval[0] == '"') {
+								joinval = csv_dequote(joinval);
+							} else if ((joinval[0] >= '0' && joinval[0] <= '9') || joinval[0] == '-') {
+								attr_type = mvt_double;
+							}
+						}
 
-						for (size_t i = 1; i < fields.size(); i++) {
-							std::string joinkey = header[i];
-							std::string joinval = fields[i];
-							int attr_type = mvt_string;
+						const char *sjoinkey = joinkey.c_str();
 
-							if (joinval.size() > 0) {
-								if (joinval[0] == '"') {
-									joinval = dequote(joinval);
-								} else if ((joinval[0] >= '0' && joinval[0] <= '9') || joinval[0] == '-') {
-									attr_type = mvt_double;
-								}
+						if (exclude.count(joinkey) == 0) {
+							mvt_value outval;
+							if (attr_type == mvt_string) {
+								outval.type = mvt_string;
+								outval.string_value = joinval;
+							} else {
+								outval.type = mvt_double;
+								outval.numeric_value.double_value = atof(joinval.c_str());
 							}
 
-							const char *sjoinkey = joinkey.c_str();
-
-							if (exclude.count(joinkey) == 0) {
-								mvt_value outval;
-								if (attr_type == mvt_string) {
-									outval.type = mvt_string;
-									outval.string_value = joinval;
-								} else {
-									outval.type = mvt_double;
-									outval.numeric_value.double_value = atof(joinval.c_str());
-								}
-
-								auto fa = attributes.find(sjoinkey);
-								if (fa != attributes.end()) {
-									attributes.erase(fa);
-								}
-
-								type_and_string tas;
-								tas.type = outval.type;
-								tas.string = joinval;
-
-								attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(joinkey, std::pair<mvt_value, type_and_string>(outval, tas)));
-								key_order.push_back(joinkey);
+							auto fa = attributes.find(sjoinkey);
+							if (fa != attributes.end()) {
+								attributes.erase(fa);
 							}
+
+							type_and_string tas;
+							tas.type = outval.type;
+							tas.string = joinval;
+
+							attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(joinkey, std::pair<mvt_value, type_and_string>(outval, tas)));
+							key_order.push_back(joinkey);
 						}
 					}
 				}
 			}
+		}
 
-			if (matched || !ifmatched) {
-				if (file_keys == layermap.end()) {
-					layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
-					file_keys = layermap.find(layer.name);
-					file_keys->second.minzoom = z;
-					file_keys->second.maxzoom = z;
-				}
+		if (matched || !ifmatched) {
+			if (file_keys == layermap.end()) {
+				layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
+				file_keys = layermap.find(layer.name);
+				file_keys->second.minzoom = z;
+				file_keys->second.maxzoom = z;
+			}
 
-				// To keep attributes in their original order instead of alphabetical
-				for (auto k : key_order) {
-					auto fa = attributes.find(k);
+			// To keep attributes in their original order instead of alphabetical
+			for (auto k : key_order) {
+				auto fa = attributes.find(k);
 
-					if (fa != attributes.end()) {
-						outlayer.tag(outfeature, k, fa->second.first);
-						add_to_file_keys(file_keys->second.file_keys, k, fa->second.second);
-						attributes.erase(fa);
-					}
+				if (fa != attributes.end()) {
+					outlayer.tag(outfeature, k, fa->second.first);
+					add_to_file_keys(file_keys->second.file_keys, k, fa->second.second);
+					attributes.erase(fa);
 				}
+			}
 
-				outfeature.type = feat.type;
-				outfeature.geometry = feat.geometry;
+			outfeature.type = feat.type;
+			outfeature.geometry = feat.geometry;
 
-				if (layer.extent != outlayer.extent) {
-					for (size_t i = 0; i < outfeature.geometry.size(); i++) {
-						outfeature.geometry[i].x = outfeature.geometry[i].x * outlayer.extent / layer.extent;
-						outfeature.geometry[i].y = outfeature.geometry[i].y * outlayer.extent / layer.extent;
-					}
+			if (layer.extent != outlayer.extent) {
+				for (size_t i = 0; i < outfeature.geometry.size(); i++) {
+					outfeature.geometry[i].x = outfeature.geometry[i].x * outlayer.extent / layer.extent;
+					outfeature.geometry[i].y = outfeature.geometry[i].y * outlayer.extent / layer.extent;
 				}
+			}
 
-				features_added++;
-				outlayer.features.push_back(outfeature);
+			outlayer.features.push_back(outfeature);
 
-				if (z < file_keys->second.minzoom) {
-					file_keys->second.minzoom = z;
-				}
-				if (z > file_keys->second.maxzoom) {
-					file_keys->second.maxzoom = z;
-				}
+			if (z < file_keys->second.minzoom) {
+				file_keys->second.minzoom = z;
+			}
+			if (z > file_keys->second.maxzoom) {
+				file_keys->second.maxzoom = z;
+			}
 
-				if (feat.type == mvt_point) {
-					file_keys->second.points++;
-				} else if (feat.type == mvt_linestring) {
-					file_keys->second.lines++;
-				} else if (feat.type == mvt_polygon) {
-					file_keys->second.polygons++;
-				}
+			if (feat.type == mvt_point) {
+				file_keys->second.points++;
+			} else if (feat.type == mvt_linestring) {
+				file_keys->second.lines++;
+			} else if (feat.type == mvt_polygon) {
+				file_keys->second.polygons++;
 			}
 		}
 	}
+}
+
+// Whether a layer can be copied to the output as it is: it must have features and be the
+// only layer by its name in the tile, and the join and the attribute exclusions must not
+// affect it. Any other layer goes through handle() so that it comes out the same way it
+// would if it were reencoded.
+bool can_copy(mvt_layer const &layer, std::map<std::string, size_t> const &layer_count, std::vector<std::string> &header, std::set<std::string> &exclude, int ifmatched) {
+	if (ifmatched || layer.features.size() == 0 || layer_count.find(layer.name)->second != 1) {
+		return false;
+	}
+
+	for (size_t i = 0; i < layer.keys.size(); i++) {
+		if (exclude.count(layer.keys[i]) != 0) {
+			return false;
+		}
+		if (header.size() > 0 && layer.keys[i] == header[0]) {
+			return false;
+		}
+	}
+
+	return true;
+}
 
-	if (features_added == 0) {
+// Count the features of a layer that is being copied into the layermap the same way handle() would
+void tally(mvt_layer &layer, int z, std::map<std::string, layermap_entry> &layermap) {
+	if (layer.features.size() == 0) {
 		return;
 	}
+
+	auto file_keys = layermap.find(layer.name);
+	if (file_keys == layermap.end()) {
+		layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
+		file_keys = layermap.find(layer.name);
+		file_keys->second.minzoom = z;
+		file_keys->second.maxzoom = z;
+	}
+
+	for (size_t f = 0; f < layer.features.size(); f++) {
+		mvt_feature &feat = layer.features[f];
+
+		for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+			type_and_string tas;
+			if (stringify_value(layer.values[feat.tags[t + 1]], tas.string, tas.type)) {
+				add_to_file_keys(file_keys->second.file_keys, layer.keys[feat.tags[t]], tas);
+			}
+		}
+
+		if (feat.type == mvt_point) {
+			file_keys->second.points++;
+		} else if (feat.type == mvt_linestring) {
+			file_keys->second.lines++;
+		} else if (feat.type == mvt_polygon) {
+			file_keys->second.polygons++;
+		}
+	}
+
+	if (z < file_keys->second.minzoom) {
+		file_keys->second.minzoom = z;
+	}
+	if (z > file_keys->second.maxzoom) {
+		file_keys->second.maxzoom = z;
+	}
 }
 
 double min(double a, double b) {
@@ -548,123 +601,314 @@ struct zxy {
 	}
 };
 
-struct arg {
-	std::map<zxy, std::vector<std::string>> inputs;
-	std::map<zxy, std::string> outputs;
+// A tile to be joined from the data for it in each of the inputs
+struct join_task {
+	zxy tile;
+	std::vector<std::string> inputs;
+	size_t size;
 
-	std::map<std::string, layermap_entry> *layermap;
+	join_task(zxy _tile)
+	    : tile(_tile), size(0) {
+	}
+
+	// For the heap, so that the largest waiting task is taken first
+	bool operator<(join_task const &other) const {
+		return size < other.size;
+	}
+};
+
+struct join_result {
+	zxy tile;
+	std::string data;
+
+	join_result(zxy _tile, std::string &_data)
+	    : tile(_tile) {
+		data.swap(_data);
+	}
+};
+
+// Tiles flow from the reader on the main thread, through a heap of waiting tasks
+// to the join workers, and from them through a queue of results to the writer.
+// Both are bounded so that reading can't run arbitrarily far ahead of writing.
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t task_added;
+	pthread_cond_t task_taken;
+	pthread_cond_t result_added;
+	pthread_cond_t result_taken;
+
+	std::vector<join_task> tasks;
+	bool reading_done;
+	std::deque<join_result> results;
+	size_t workers_running;
+	size_t limit;
+
+	sqlite3 *outdb;
+	const char *outdir;
 
 	std::vector<std::string> *header;
-	std::map<std::string, std::vector<std::string>> *mapping;
+	csv_table const *joins;
 	std::set<std::string> *exclude;
 	std::set<std::string> *keep_layers;
 	std::set<std::string> *remove_layers;
 	int ifmatched;
 };
 
-void *join_worker(void *v) {
-	arg *a = (arg *) v;
+struct worker_arg {
+	pipeline *p;
+	std::map<std::string, layermap_entry> *layermap;
+};
+
+static void lock(pipeline *p) {
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock(pipeline *p) {
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for(pthread_cond_t *cond, pipeline *p) {
+	if (pthread_cond_wait(cond, &p->lock) != 0) {
+		perror("pthread_cond_wait");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns true and the compressed tile in out if the joined tile has any features
+bool join_tile(join_task &task, pipeline *p, std::map<std::string, layermap_entry> &layermap, std::string &out) {
+	std::vector<mvt_tile> tiles;
+	tiles.resize(task.inputs.size());
 
-	for (auto ai = a->inputs.begin(); ai != a->inputs.end(); ++ai) {
-		mvt_tile tile;
+	bool unchanged = true;  // no layer left out and none decoded and reencoded
+	std::map<std::string, size_t> layer_count;
 
-		for (size_t i = 0; i < ai->second.size(); i++) {
-			handle(ai->second[i], ai->first.z, ai->first.x, ai->first.y, *(a->layermap), *(a->header), *(a->mapping), *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, tile);
+	for (size_t i = 0; i < task.inputs.size(); i++) {
+		decode_tile(task.inputs[i], task.tile.z, task.tile.x, task.tile.y, tiles[i]);
+
+		for (size_t l = 0; l < tiles[i].layers.size(); l++) {
+			std::string const &name = tiles[i].layers[l].name;
+
+			if ((p->keep_layers->size() > 0 && p->keep_layers->count(name) == 0) || p->remove_layers->count(name) != 0) {
+				unchanged = false;
+			} else {
+				layer_count[name]++;
+			}
+		}
+	}
+
+	// Layers that don't need to change are spliced into the output as they are,
+	// and only the others have their geometry decoded and their features joined
+	mvt_tile outtile;
+	for (size_t i = 0; i < tiles.size(); i++) {
+		for (size_t l = 0; l < tiles[i].layers.size(); l++) {
+			mvt_layer &layer = tiles[i].layers[l];
+
+			if (layer_count.count(layer.name) == 0) {
+				continue;
+			}
+
+			if (can_copy(layer, layer_count, *(p->header), *(p->exclude), p->ifmatched)) {
+				tally(layer, task.tile.z, layermap);
+				outtile.layers.push_back(std::move(layer));
+			} else {
+				unchanged = false;
+
+				mvt_layer decoded;
+				decoded.decode(layer.raw, true);
+				handle(decoded, task.tile.z, layermap, *(p->header), p->joins, *(p->exclude), p->ifmatched, outtile);
+			}
 		}
+	}
 
-		ai->second.clear();
+	tiles.clear();
 
+	// A tile from only one input, already compressed or not as the output will be,
+	// can be copied whole if none of its layers changed. One that is over the size limit
+	// is compressed again instead, since it may be smaller after that.
+	if (unchanged && task.inputs.size() == 1 && is_compressed(task.inputs[0]) == !pC && (pk || task.inputs[0].size() <= 500000)) {
 		bool anything = false;
-		for (size_t i = 0; i < tile.layers.size(); i++) {
-			if (tile.layers[i].features.size() > 0) {
+		for (size_t i = 0; i < outtile.layers.size(); i++) {
+			if (outtile.layers[i].features.size() > 0) {
 				anything = true;
 				break;
 			}
 		}
 
-		if (anything) {
-			std::string pbf = tile.encode();
-			std::string compressed;
+		if (!anything) {
+			return false;
+		}
 
-			if (!pC) {
-				compress(pbf, compressed);
-			} else {
-				compressed = pbf;
-			}
+		out.swap(task.inputs[0]);
+		task.inputs.clear();
+		return true;
+	}
 
-			if (!pk && compressed.size() > 500000) {
-				fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", ai->first.z, ai->first.x, ai->first.y, (long long) compressed.size());
-			} else {
-				a->outputs.insert(std::pair<zxy, std::string>(ai->first, compressed));
-			}
+	task.inputs.clear();
+
+	bool anything = false;
+	for (size_t i = 0; i < outtile.layers.size(); i++) {
+		if (outtile.layers[i].features.size() > 0) {
+			anything = true;
+			break;
 		}
 	}
 
-	return NULL;
-}
+	if (!anything) {
+		return false;
+	}
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers) {
-	pthread_t pthreads[CPUS];
-	std::vector<arg> args;
+	std::string pbf = outtile.encode();
 
-	for (size_t i = 0; i < CPUS; i++) {
-		args.push_back(arg());
+	if (!pC) {
+		compress(pbf, out);
+	} else {
+		out.swap(pbf);
+	}
 
-		args[i].layermap = &layermaps[i];
-		args[i].header = &header;
-		args[i].mapping = &mapping;
-		args[i].exclude = &exclude;
-		args[i].keep_layers = &keep_layers;
-		args[i].remove_layers = &remove_layers;
-		args[i].ifmatched = ifmatched;
+	if (!pk && out.size() > 500000) {
+		fprintf(stderr, "Tile %lld/%lld/%lld size is %lld, >500000. Skipping this tile\n.", task.tile.z, task.tile.x, task.tile.y, (long long) out.size());
+		return false;
 	}
 
-	size_t count = 0;
-	// This isn't careful about distributing tasks evenly across CPUs,
-	// but, from testing, it actually takes a little longer to do
-	// the proper allocation than is saved by perfectly balanced threads.
-	for (auto ai = tasks.begin(); ai != tasks.end(); ++ai) {
-		args[count].inputs.insert(*ai);
-		count = (count + 1) % CPUS;
-
-		if (ai == tasks.begin()) {
-			if (!quiet) {
-				fprintf(stderr, "%lld/%lld/%lld  \r", ai->first.z, ai->first.x, ai->first.y);
+	return true;
+}
+
+void *join_worker(void *v) {
+	worker_arg *a = (worker_arg *) v;
+	pipeline *p = a->p;
+
+	lock(p);
+	while (true) {
+		while (p->tasks.size() == 0 && !p->reading_done) {
+			wait_for(&p->task_added, p);
+		}
+		if (p->tasks.size() == 0) {
+			break;
+		}
+
+		std::pop_heap(p->tasks.begin(), p->tasks.end());
+		join_task task = std::move(p->tasks.back());
+		p->tasks.pop_back();
+		pthread_cond_signal(&p->task_taken);
+		unlock(p);
+
+		std::string compressed;
+		bool anything = join_tile(task, p, *(a->layermap), compressed);
+
+		lock(p);
+		if (anything) {
+			while (p->results.size() >= p->limit) {
+				wait_for(&p->result_taken, p);
 			}
+
+			p->results.push_back(join_result(task.tile, compressed));
+			pthread_cond_signal(&p->result_added);
 		}
 	}
 
-	for (size_t i = 0; i < CPUS; i++) {
-		if (pthread_create(&pthreads[i], NULL, join_worker, &args[i]) != 0) {
-			perror("pthread_create");
-			exit(EXIT_FAILURE);
-		}
+	p->workers_running--;
+	if (p->workers_running == 0) {
+		pthread_cond_signal(&p->result_added);
 	}
+	unlock(p);
 
-	for (size_t i = 0; i < CPUS; i++) {
-		void *retval;
+	return NULL;
+}
 
-		if (pthread_join(pthreads[i], &retval) != 0) {
-			perror("pthread_join");
+void *write_worker(void *v) {
+	pipeline *p = (pipeline *) v;
+
+	lock(p);
+	while (true) {
+		while (p->results.size() == 0 && p->workers_running > 0) {
+			wait_for(&p->result_added, p);
+		}
+		if (p->results.size() == 0) {
+			break;
 		}
 
-		for (auto ai = args[i].outputs.begin(); ai != args[i].outputs.end(); ++ai) {
-			if (outdb != NULL) {
-				mbtiles_write_tile(outdb, ai->first.z, ai->first.x, ai->first.y, ai->second.data(), ai->second.size());
-			} else if (outdir != NULL) {
-				dir_write_tile(outdir, ai->first.z, ai->first.x, ai->first.y, ai->second);
-			}
+		join_result r = std::move(p->results.front());
+		p->results.pop_front();
+		pthread_cond_signal(&p->result_taken);
+		unlock(p);
+
+		if (p->outdb != NULL) {
+			mbtiles_write_tile(p->outdb, r.tile.z, r.tile.x, r.tile.y, r.data.data(), r.data.size());
+		} else if (p->outdir != NULL) {
+			dir_write_tile(p->outdir, r.tile.z, r.tile.x, r.tile.y, r.data);
 		}
+
+		lock(p);
 	}
+	unlock(p);
+
+	return NULL;
+}
+
+void add_task(pipeline *p, join_task &task) {
+	lock(p);
+	while (p->tasks.size() >= p->limit) {
+		wait_for(&p->task_taken, p);
+	}
+
+	p->tasks.push_back(std::move(task));
+	std::push_heap(p->tasks.begin(), p->tasks.end());
+	pthread_cond_signal(&p->task_added);
+	unlock(p);
 }
 
-void decode(struct reader *readers, char *map, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name) {
+void decode(struct reader *readers, char *map, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, csv_table const *joins, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name) {
 	std::vector<std::map<std::string, layermap_entry>> layermaps;
 	for (size_t i = 0; i < CPUS; i++) {
 		layermaps.push_back(std::map<std::string, layermap_entry>());
 	}
 
-	std::map<zxy, std::vector<std::string>> tasks;
+	pipeline work;
+	pthread_mutex_init(&work.lock, NULL);
+	pthread_cond_init(&work.task_added, NULL);
+	pthread_cond_init(&work.task_taken, NULL);
+	pthread_cond_init(&work.result_added, NULL);
+	pthread_cond_init(&work.result_taken, NULL);
+	work.reading_done = false;
+	work.workers_running = CPUS;
+	work.limit = 10 * CPUS;
+	work.outdb = outdb;
+	work.outdir = outdir;
+	work.header = &header;
+	work.joins = joins;
+	work.exclude = &exclude;
+	work.keep_layers = &keep_layers;
+	work.remove_layers = &remove_layers;
+	work.ifmatched = ifmatched;
+
+	pthread_t pthreads[CPUS];
+	std::vector<worker_arg> args;
+	args.resize(CPUS);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		args[i].p = &work;
+		args[i].layermap = &layermaps[i];
+
+		if (pthread_create(&pthreads[i], NULL, join_worker, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_t writer;
+	if (pthread_create(&writer, NULL, write_worker, &work) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	join_task task = join_task(zxy(-1, -1, -1));
+	long long ntasks = 0;
 	double minlat = INT_MAX;
 	double minlon = INT_MAX;
 	double maxlat = INT_MIN;
@@ -692,18 +936,22 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 		maxlat = max(lat1, maxlat);
 		maxlon = max(lon2, maxlon);
 
-		zxy tile = zxy(r->zoom, r->x, r->y);
-		if (tasks.count(tile) == 0) {
-			tasks.insert(std::pair<zxy, std::vector<std::string>>(tile, std::vector<std::string>()));
-		}
-		auto f = tasks.find(tile);
-		f->second.push_back(r->data);
+		task.tile = zxy(r->zoom, r->x, r->y);
+		task.size += r->data.size();
+		task.inputs.push_back(std::move(r->data));
 
+		// The readers are in tile order, so once the next one is on a different tile,
+		// this tile has been found in all of them
 		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
-			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers);
-				tasks.clear();
+			if (ntasks % (100 * CPUS) == 0) {
+				if (!quiet) {
+					fprintf(stderr, "%lld/%lld/%lld  \r", task.tile.z, task.tile.x, task.tile.y);
+				}
 			}
+			ntasks++;
+
+			add_task(&work, task);
+			task = join_task(zxy(-1, -1, -1));
 		}
 
 		if (r->db != NULL) {
@@ -754,7 +1002,30 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 	st->minlat = min(minlat, st->minlat);
 	st->maxlat = max(maxlat, st->maxlat);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers);
+	lock(&work);
+	work.reading_done = true;
+	pthread_cond_broadcast(&work.task_added);
+	unlock(&work);
+
+	for (size_t i = 0; i < CPUS; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
+
+	void *retval;
+	if (pthread_join(writer, &retval) != 0) {
+		perror("pthread_join");
+	}
+
+	pthread_mutex_destroy(&work.lock);
+	pthread_cond_destroy(&work.task_added);
+	pthread_cond_destroy(&work.task_taken);
+	pthread_cond_destroy(&work.result_added);
+	pthread_cond_destroy(&work.result_taken);
+
 	layermap = merge_layermaps(layermaps);
 
 	struct reader *next;
@@ -906,90 +1177,15 @@ void decode(struct reader *readers, char *map, std::map<std::string, layermap_en
 }
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-f] [-i] [-pk] [-pC] [-c joins.csv] [-x exclude ...] -o new.mbtiles source.mbtiles ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-f] [-i] [-pk] [-pC] [-c joins.csv [--csv-index joins.index]] [-x exclude ...] -o new.mbtiles source.mbtiles ...\n", argv[0]);
 	exit(EXIT_FAILURE);
 }
 
-#define MAXLINE 10000 /* XXX */
-
-std::vector<std::string> split(char *s) {
-	std::vector<std::string> ret;
-
-	while (*s && *s != '\n' && *s != '\r') {
-		char *start = s;
-		int within = 0;
-
-		for (; *s && *s != '\n' && *s != '\r'; s++) {
-			if (*s == '"') {
-				within = !within;
-			}
-
-			if (*s == ',' && !within) {
-				break;
-			}
-		}
-
-		std::string v = std::string(start, s - start);
-		ret.push_back(v);
-
-		if (*s == ',') {
-			s++;
-
-			while (*s && isspace(*s)) {
-				s++;
-			}
-		}
-	}
-
-	return ret;
-}
-
-std::string dequote(std::string s) {
-	std::string out;
-	for (size_t i = 0; i < s.size(); i++) {
-		if (s[i] == '"') {
-			if (i + 1 < s.size() && s[i + 1] == '"') {
-				out.push_back('"');
-			}
-		} else {
-			out.push_back(s[i]);
-		}
-	}
-	return out;
-}
-
-void readcsv(char *fn, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping) {
-	FILE *f = fopen(fn, "r");
-	if (f == NULL) {
-		perror(fn);
-		exit(EXIT_FAILURE);
-	}
-
-	char s[MAXLINE];
-	if (fgets(s, MAXLINE, f)) {
-		header = split(s);
-
-		for (size_t i = 0; i < header.size(); i++) {
-			header[i] = dequote(header[i]);
-		}
-	}
-	while (fgets(s, MAXLINE, f)) {
-		std::vector<std::string> line = split(s);
-		if (line.size() > 0) {
-			line[0] = dequote(line[0]);
-		}
-
-		for (size_t i = 0; i < line.size() && i < header.size(); i++) {
-			// printf("putting %s\n", line[0].c_str());
-			mapping.insert(std::pair<std::string, std::vector<std::string>>(line[0], line));
-		}
-	}
-
-	if (fclose(f) != 0) {
-		perror("fclose");
-		exit(EXIT_FAILURE);
-	}
-}
+// Values for long options that have no single-letter equivalent
+#define OPT_COMPRESSION_LEVEL 1
+#define OPT_SQLITE_PAGE_SIZE 2
+#define OPT_SQLITE_CACHE_SIZE 3
+#define OPT_CSV_INDEX 4
 
 int main(int argc, char **argv) {
 	char *out_mbtiles = NULL;
@@ -1010,7 +1206,8 @@ int main(int argc, char **argv) {
 	}
 
 	std::vector<std::string> header;
-	std::map<std::string, std::vector<std::string>> mapping;
+	csv_table *joins = NULL;
+	const char *csv_index = NULL;
 
 	std::set<std::string> exclude;
 	std::set<std::string> keep_layers;
@@ -1028,6 +1225,7 @@ int main(int argc, char **argv) {
 		{"description", required_argument, 0, 'N'},
 		{"prevent", required_argument, 0, 'p'},
 		{"csv", required_argument, 0, 'c'},
+		{"csv-index", required_argument, 0, OPT_CSV_INDEX},
 		{"exclude", required_argument, 0, 'x'},
 		{"layer", required_argument, 0, 'l'},
 		{"exclude-layer", required_argument, 0, 'L'},
@@ -1035,6 +1233,10 @@ int main(int argc, char **argv) {
 
 		{"no-tile-size-limit", no_argument, &pk, 1},
 		{"no-tile-compression", no_argument, &pC, 1},
+		{"compression-level", required_argument, 0, OPT_COMPRESSION_LEVEL},
+		{"sqlite-page-size", required_argument, 0, OPT_SQLITE_PAGE_SIZE},
+		{"sqlite-cache-size", required_argument, 0, OPT_SQLITE_CACHE_SIZE},
+		{"deduplicate-tiles", no_argument, &mbtiles_deduplicate, 1},
 
 		{0, 0, 0, 0},
 	};
@@ -1098,6 +1300,30 @@ int main(int argc, char **argv) {
 			}
 			break;
 
+		case OPT_SQLITE_PAGE_SIZE:
+			mbtiles_page_size = atoi(optarg);
+			if (mbtiles_page_size < 512 || mbtiles_page_size > 65536 || (mbtiles_page_size & (mbtiles_page_size - 1)) != 0) {
+				fprintf(stderr, "%s: --sqlite-page-size must be a power of 2 between 512 and 65536\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_SQLITE_CACHE_SIZE:
+			mbtiles_cache_size = atoll(optarg);
+			if (mbtiles_cache_size <= 0) {
+				fprintf(stderr, "%s: --sqlite-cache-size must be positive\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case OPT_COMPRESSION_LEVEL:
+			compression_level = atoi(optarg);
+			if (compression_level < 0 || compression_level > 9) {
+				fprintf(stderr, "%s: --compression-level must be between 0 and 9\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
 		case 'c':
 			if (csv != NULL) {
 				fprintf(stderr, "Only one -c for now\n");
@@ -1105,7 +1331,10 @@ int main(int argc, char **argv) {
 			}
 
 			csv = optarg;
-			readcsv(csv, header, mapping);
+			break;
+
+		case OPT_CSV_INDEX:
+			csv_index = optarg;
 			break;
 
 		case 'x':
@@ -1143,6 +1372,16 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
+	if (csv_index != NULL && csv == NULL) {
+		fprintf(stderr, "%s: --csv-index needs a -c file to index\n", argv[0]);
+		usage(argv);
+	}
+
+	if (csv != NULL) {
+		joins = csv_open(csv, csv_index);
+		header = joins->header;
+	}
+
 	if (out_mbtiles != NULL) {
 		if (force) {
 			unlink(out_mbtiles);
@@ -1182,7 +1421,7 @@ int main(int argc, char **argv) {
 		*rr = r;
 	}
 
-	decode(readers, csv, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name);
+	decode(readers, csv, layermap, outdb, out_dir, &st, header, joins, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -1197,8 +1436,15 @@ int main(int argc, char **argv) {
 	mbtiles_write_metadata(outdb, out_dir, name.c_str(), st.minzoom, st.maxzoom, st.minlat, st.minlon, st.maxlat, st.maxlon, st.midlat, st.midlon, 0, attribution.size() != 0 ? attribution.c_str() : NULL, layermap, true, description.c_str());
 
 	if (outdb != NULL) {
+		if (!quiet) {
+			mbtiles_report_deduplication(outdb);
+		}
 		mbtiles_close(outdb, argv[0]);
 	}
 
+	if (joins != NULL) {
+		delete joins;
+	}
+
 	return 0;
 }
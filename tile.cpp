@@ -6,6 +6,7 @@
 #include <fstream>
 #include <string>
 #include <stack>
+#include <deque>
 #include <vector>
 #include <map>
 #include <set>
@@ -24,6 +25,7 @@
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <chrono>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include "mvt.hpp"
@@ -32,6 +34,8 @@
 #include "geometry.hpp"
 #include "tile.hpp"
 #include "pool.hpp"
+#include "threadpool.hpp"
+#include "tilewriter.hpp"
 #include "projection.hpp"
 #include "serial.hpp"
 #include "options.hpp"
@@ -43,13 +47,13 @@ extern "C" {
 }
 
 #include "plugin.hpp"
+#include "evaluator.hpp"
 
 #define CMD_BITS 3
 
 #define XSTRINGIFY(s) STRINGIFY(s)
 #define STRINGIFY(s) #s
 
-pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t var_lock = PTHREAD_MUTEX_INITIALIZER;
 
 std::vector<mvt_geometry> to_feature(drawvec &geom) {
@@ -205,7 +209,7 @@ int metacmp(int m1, const std::vector<long long> &keys1, const std::vector<long
 	}
 }
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int line_detail, int *within, long long *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int line_detail, int *within, long long *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, int m, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent, bool full) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -243,9 +247,17 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 			sy = ty << (32 - z);
 		}
 
+		// With -aQ, each child gets only the part of the geometry that falls within it
+		// and its buffer, plus a pixel of margin so that the child's own clipping to its
+		// buffer doesn't land on coordinates that were rounded here.
+		bool clip_children = additional[A_CLIP_TO_CHILD_TILES] && !full && !prevent[P_CLIPPING] && !prevent[P_DUPLICATION];
+
 		drawvec geom2;
-		for (size_t i = 0; i < geom.size(); i++) {
-			geom2.push_back(draw(geom[i].op, (geom[i].x + sx) >> geometry_scale, (geom[i].y + sy) >> geometry_scale));
+		if (!full && !clip_children) {
+			for (size_t i = 0; i < geom.size(); i++) {
+				geom2.push_back(draw(geom[i].op, (geom[i].x + sx) >> geometry_scale, (geom[i].y + sy) >> geometry_scale));
+				geom2.back().importance = geom[i].importance;
+			}
 		}
 
 		for (xo = bbox2[0]; xo <= bbox2[2]; xo++) {
@@ -253,6 +265,34 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 				unsigned jx = tx * span + xo;
 				unsigned jy = ty * span + yo;
 
+				if (clip_children) {
+					long long child = 1LL << (32 - nextzoom);
+					long long margin = (buffer + 1) * child / 256;
+					long long minx = xo * child - margin;
+					long long miny = yo * child - margin;
+					long long maxx = (xo + 1) * child + margin;
+					long long maxy = (yo + 1) * child + margin;
+
+					drawvec clipped;
+					if (t == VT_POLYGON) {
+						clipped = simple_clip_poly(geom, minx, miny, maxx, maxy);
+					} else if (t == VT_LINE) {
+						clipped = clip_lines(geom, minx, miny, maxx, maxy);
+					} else {
+						clipped = clip_point(geom, minx, miny, maxx, maxy);
+					}
+					clipped = remove_noop(clipped, t, 0);
+					if (clipped.size() == 0) {
+						continue;
+					}
+
+					geom2.clear();
+					for (size_t i = 0; i < clipped.size(); i++) {
+						geom2.push_back(draw(clipped[i].op, (clipped[i].x + sx) >> geometry_scale, (clipped[i].y + sy) >> geometry_scale));
+						geom2.back().importance = clipped[i].importance;
+					}
+				}
+
 				// j is the shard that the child tile's data is being written to.
 				//
 				// Be careful: We can't jump more zoom levels than max_zoom_increment
@@ -294,16 +334,15 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 					sf.tippecanoe_maxzoom = tippecanoe_maxzoom;
 					sf.metapos = metastart;
 					sf.geometry = geom2;
+					sf.full = full;
 					sf.index = index;
 					sf.extent = extent;
 					sf.m = m;
 					sf.feature_minzoom = feature_minzoom;
 
 					if (metastart < 0) {
-						for (int i = 0; i < m; i++) {
-							sf.keys.push_back(metakeys[i]);
-							sf.values.push_back(metavals[i]);
-						}
+						sf.keys.assign(metakeys.begin(), metakeys.begin() + m);
+						sf.values.assign(metavals.begin(), metavals.begin() + m);
 					}
 
 					serialize_feature(geomfile[j], &sf, &geompos[j], fname, initial_x[segment] >> geometry_scale, initial_y[segment] >> geometry_scale, true);
@@ -418,7 +457,7 @@ void *partial_feature_worker(void *v) {
 				}
 
 				if (!already_marked) {
-					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0);
+					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0, additional[A_VERTEX_IMPORTANCE]);
 
 					if (t != VT_POLYGON || ngeom.size() >= 3) {
 						geom = ngeom;
@@ -867,7 +906,7 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 			}
 		}
 		if (!(prevent[P_SIMPLIFY] || (z == maxzoom && prevent[P_SIMPLIFY_LOW]) || (z < maxzoom && additional[A_GRID_LOW_ZOOMS]))) {
-			simplified_arcs[ai->second] = simplify_lines(dv, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, 3);
+			simplified_arcs[ai->second] = simplify_lines(dv, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, 3, additional[A_VERTEX_IMPORTANCE]);
 		} else {
 			simplified_arcs[ai->second] = dv;
 		}
@@ -1132,7 +1171,11 @@ long long choose_minextent(std::vector<long long> &extents, double f) {
 }
 
 struct write_tile_args {
-	struct task *tasks;
+	struct scheduler *sched;
+	size_t thread;
+	char **geom_map;
+	long long *geomfile_pos;
+	std::vector<long long> *geomfile_tiles;
 	char *metabase;
 	char *stringpool;
 	int min_detail;
@@ -1164,6 +1207,7 @@ struct write_tile_args {
 	unsigned *initial_y;
 	volatile int *running;
 	int err;
+	volatile int *stop_zoom = NULL;  // if set, tiles deeper than this are no longer wanted
 	std::vector<std::map<std::string, layermap_entry>> *layermaps;
 	std::vector<std::vector<std::string>> *layer_unmaps;
 	size_t pass;
@@ -1176,17 +1220,38 @@ struct write_tile_args {
 	double fraction_out;
 	const char *prefilter;
 	const char *postfilter;
+	feature_filter const *filter;
 	bool still_dropping;
 	int wrote_zoom;
 	size_t tiling_seg;
+	long long retry_cache_limit;
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
+	if (sf.full) {
+		sf.geometry = full_tile_square(z, buffer);
+		return false;
+	}
+
 	int quick = quick_check(sf.bbox, z, buffer);
 	if (quick == 0) {
 		return true;
 	}
 
+	// A polygon that covers the whole tile, buffer and all, clips to the tile's square.
+	// Its children are covered too, so they only need to be told so.
+	if (quick == 2 && sf.t == VT_POLYGON && z != 0 && !prevent[P_DUPLICATION] && !prevent[P_CLIPPING]) {
+		long long area = 1LL << (32 - z);
+		long long clip_buffer = buffer * area / 256;
+
+		if (sf.bbox[0] <= -clip_buffer && sf.bbox[1] <= -clip_buffer && sf.bbox[2] >= area + clip_buffer && sf.bbox[3] >= area + clip_buffer &&
+		    tile_within_polygon(sf.geometry, z, buffer)) {
+			sf.geometry = full_tile_square(z, buffer);
+			sf.full = true;
+			return false;
+		}
+	}
+
 	if (z == 0) {
 		if (sf.bbox[0] < 0 || sf.bbox[2] > 1LL << 32) {
 			// If the geometry extends off the edge of the world, concatenate on another copy
@@ -1257,9 +1322,31 @@ bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
 	return false;
 }
 
-serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, int line_detail, FILE **geomfile, long long *geompos, volatile double *oprogress, double todo, const char *fname, int child_shards) {
+// A feature's attributes, as offsets into the string pool, for the feature filter
+struct pool_attributes {
+	size_t m;
+	std::vector<long long> const *keys;
+	std::vector<long long> const *values;
+	char *stringpool;
+};
+
+static bool lookup_pool_attribute(void *data, const char *key, int *type, const char **value) {
+	pool_attributes *pa = (pool_attributes *) data;
+
+	for (size_t i = 0; i < pa->m; i++) {
+		if (strcmp(pa->stringpool + (*pa->keys)[i] + 1, key) == 0) {
+			*type = pa->stringpool[(*pa->values)[i]];
+			*value = pa->stringpool + (*pa->values)[i] + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, volatile long long *along, long long alongminus, int buffer, int *within, bool *first_time, int line_detail, FILE **geomfile, long long *geompos, volatile double *oprogress, double todo, const char *fname, int child_shards, feature_filter const *filter, char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
 	while (1) {
-		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
+		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, buffer);
 		if (sf.t < 0) {
 			return sf;
 		}
@@ -1284,7 +1371,7 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 
 		if (*first_time && pass == 1) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, line_detail, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, line_detail, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.m, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent, sf.full);
 			}
 		}
 
@@ -1302,6 +1389,26 @@ serial_feature next_feature(FILE *geoms, long long *geompos_in, char *metabase,
 			continue;
 		}
 
+		if (filter != NULL) {
+			pool_attributes pa;
+			pa.m = sf.m;
+			pa.keys = &sf.keys;
+			pa.values = &sf.values;
+			pa.stringpool = stringpool + pool_off[sf.segment];
+
+			filter_feature ff;
+			ff.type = sf.t;
+			ff.z = z;
+			ff.has_id = sf.has_id;
+			ff.id = sf.id;
+			ff.lookup = lookup_pool_attribute;
+			ff.data = &pa;
+
+			if (!evaluate_feature_filter(filter, (*layer_unmaps)[sf.segment][sf.layer], ff)) {
+				continue;
+			}
+		}
+
 		return sf;
 	}
 }
@@ -1340,13 +1447,19 @@ struct run_prefilter_args {
 	char *stringpool;
 	long long *pool_off;
 	FILE *prefilter_fp;
+	bool persistent;
+	feature_filter const *filter;
 };
 
 void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
 
+	if (rpa->persistent) {
+		filter_tile_start(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty);
+	}
+
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->line_detail, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards);
+		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->line_detail, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps);
 		if (sf.t < 0) {
 			break;
 		}
@@ -1382,6 +1495,11 @@ void *run_prefilter(void *v) {
 		layer_to_geojson(rpa->prefilter_fp, tmp_layer, 0, 0, 0, false, true, false, sf.index, sf.seq, sf.extent, true);
 	}
 
+	if (rpa->persistent) {
+		filter_tile_end(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty, "prefilter");
+		return NULL;
+	}
+
 	if (fclose(rpa->prefilter_fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -1397,6 +1515,102 @@ void *run_prefilter(void *v) {
 	return NULL;
 }
 
+// Approximately how much memory a feature occupies, for keeping
+// the features of a tile that is being retried within the budget
+long long feature_bytes(serial_feature const &sf) {
+	long long bytes = sizeof(serial_feature);
+	bytes += sf.geometry.size() * sizeof(draw);
+	bytes += (sf.keys.size() + sf.values.size()) * sizeof(long long);
+	for (size_t i = 0; i < sf.full_keys.size(); i++) {
+		bytes += sizeof(std::string) + sf.full_keys[i].size();
+	}
+	for (size_t i = 0; i < sf.full_values.size(); i++) {
+		bytes += sizeof(serial_val) + sf.full_values[i].s.size();
+	}
+	return bytes;
+}
+
+// A running estimate, for each zoom level, of how many compressed bytes
+// each vertex or attribute of the features going into a tile turns into,
+// learned from the tiles that have been made so far. Locked with var_lock.
+static double size_model_bytes[MAX_ZOOM + 1];
+static double size_model_units[MAX_ZOOM + 1];
+static long long size_model_tiles[MAX_ZOOM + 1];
+
+void learn_tile_size(int z, long long units, size_t bytes) {
+	if (pthread_mutex_lock(&var_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	size_model_bytes[z] += bytes;
+	size_model_units[z] += units;
+	size_model_tiles[z]++;
+
+	if (pthread_mutex_unlock(&var_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns -1 if there aren't enough tiles yet at this zoom level to say
+double predict_tile_size(int z, long long units) {
+	double estimate = -1;
+
+	if (pthread_mutex_lock(&var_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	if (size_model_tiles[z] >= 4 && size_model_units[z] > 0) {
+		estimate = units * size_model_bytes[z] / size_model_units[z];
+	}
+
+	if (pthread_mutex_unlock(&var_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return estimate;
+}
+
+// Tiles that had to be made again to fit within the size limits,
+// and how much reading and clipping of features the retry cache saved.
+// Locked with var_lock.
+static long long retried_tiles = 0;
+static long long tile_retries = 0;
+static long long cached_retries = 0;
+static double retry_seconds_saved = 0;
+
+void note_retries(int z, unsigned tx, unsigned ty, int retries) {
+	if (retries == 0) {
+		return;
+	}
+
+	if (pthread_mutex_lock(&var_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	retried_tiles++;
+	tile_retries += retries;
+
+	if (pthread_mutex_unlock(&var_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!quiet) {
+		fprintf(stderr, "tile %d/%u/%u fit after %d %s    \n", z, tx, ty, retries, retries == 1 ? "retry" : "retries");
+	}
+}
+
+void report_retries() {
+	if (!quiet && tile_retries > 0) {
+		fprintf(stderr, "%lld tiles were retried %lld times to fit; %lld retries reused features from memory, saving %.2f seconds\n", retried_tiles, tile_retries, cached_retries, retry_seconds_saved);
+	}
+}
+
 long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, volatile long long *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, volatile int *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
@@ -1428,10 +1642,29 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 	bool has_polygons = false;
 
+	// The features that come out of reading and clipping are the same every time
+	// the tile is retried, so once a tile has had to be retried, keep them in memory,
+	// if they fit in the budget, instead of reading and clipping them again for each
+	// further retry. The first attempt moves the features into the tile without
+	// keeping copies, since most tiles are never retried.
+	std::vector<serial_feature> retry_cache;
+	long long retry_cache_bytes = 0;
+	bool retry_caching = false;
+	bool retry_cached = false;
+	long long cached_original_features = 0;
+	long long cached_unclipped_features = 0;
+	double read_seconds = 0;
+	int retries = 0;
+	bool predicted = !additional[A_PREDICT_TILE_SIZES] || prevent[P_KILOBYTE_LIMIT];
+
 	bool first_time = true;
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
-	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
+	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0, retries++) {
+		if (retries == 1 && prefilter == NULL) {
+			retry_caching = true;
+		}
+
 		long long count = 0;
 		double accum_area = 0;
 
@@ -1444,9 +1677,11 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 
 		long long original_features = 0;
 		long long unclipped_features = 0;
+		long long units = 0;  // vertices and attributes, for the size model
 
 		std::vector<struct partial> partials;
 		std::map<std::string, std::vector<coalesce>> layers;
+		bool points_only = true;
 		std::vector<unsigned long long> indices;
 		std::vector<long long> extents;
 
@@ -1455,7 +1690,7 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		memset(within, '\0', child_shards * sizeof(int));
 		memset(geompos, '\0', child_shards * sizeof(long long));
 
-		if (*geompos_in != og) {
+		if (*geompos_in != og && !retry_cached) {
 			if (fseek(geoms, og, SEEK_SET) != 0) {
 				perror("fseek geom");
 				exit(EXIT_FAILURE);
@@ -1466,17 +1701,23 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 		int prefilter_write = -1, prefilter_read = -1;
 		pid_t prefilter_pid = 0;
 		FILE *prefilter_fp = NULL;
-		pthread_t prefilter_writer;
+		job prefilter_writer;
 		run_prefilter_args rpa;  // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
+		filter_process *prefilter_process = NULL;
 
 		if (prefilter != NULL) {
-			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
-			prefilter_fp = fdopen(prefilter_write, "w");
-			if (prefilter_fp == NULL) {
-				perror("freopen prefilter");
-				exit(EXIT_FAILURE);
+			if (filter_processes > 0) {
+				prefilter_process = acquire_filter(prefilter, false);
+				prefilter_fp = prefilter_process->to;
+			} else {
+				setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
+				prefilter_fp = fdopen(prefilter_write, "w");
+				if (prefilter_fp == NULL) {
+					perror("freopen prefilter");
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			rpa.geoms = geoms;
@@ -1509,36 +1750,69 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
 			rpa.prefilter_fp = prefilter_fp;
+			rpa.persistent = (prefilter_process != NULL);
+			rpa.filter = arg->filter;
 			rpa.layer_unmaps = layer_unmaps;
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
 
-			if (pthread_create(&prefilter_writer, NULL, run_prefilter, &rpa) != 0) {
-				perror("pthread_create (prefilter writer)");
-				exit(EXIT_FAILURE);
-			}
+			threadpool_start(&prefilter_writer, run_prefilter, &rpa);
 
-			prefilter_read_fp = fdopen(prefilter_read, "r");
-			if (prefilter_read_fp == NULL) {
-				perror("fdopen prefilter output");
-				exit(EXIT_FAILURE);
+			if (prefilter_process != NULL) {
+				prefilter_jp = prefilter_process->jp;
+			} else {
+				prefilter_read_fp = fdopen(prefilter_read, "r");
+				if (prefilter_read_fp == NULL) {
+					perror("fdopen prefilter output");
+					exit(EXIT_FAILURE);
+				}
+				prefilter_jp = json_begin_file(prefilter_read_fp);
 			}
-			prefilter_jp = json_begin_file(prefilter_read_fp);
+		}
+
+		auto read_start = std::chrono::steady_clock::now();
+		size_t retry_cache_next = 0;
+		if (retry_cached) {
+			original_features = cached_original_features;
+			unclipped_features = cached_unclipped_features;
 		}
 
 		while (1) {
-			serial_feature sf;
+			serial_feature read_sf;
+			serial_feature *sfp;
 
-			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, line_detail, geomfile, geompos, &oprogress, todo, fname, child_shards);
+			if (retry_cached) {
+				if (retry_cache_next >= retry_cache.size()) {
+					break;
+				}
+				sfp = &retry_cache[retry_cache_next++];
 			} else {
-				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
-			}
+				if (prefilter == NULL) {
+					read_sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, within, &first_time, line_detail, geomfile, geompos, &oprogress, todo, fname, child_shards, arg->filter, stringpool, pool_off, layer_unmaps);
+				} else {
+					read_sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
+				}
 
-			if (sf.t < 0) {
-				break;
+				if (read_sf.t < 0) {
+					break;
+				}
+
+				sfp = &read_sf;
+				if (retry_caching) {
+					retry_cache_bytes += feature_bytes(read_sf);
+
+					if (retry_cache_bytes > arg->retry_cache_limit) {
+						std::vector<serial_feature>().swap(retry_cache);
+						retry_caching = false;
+					} else {
+						retry_cache.push_back(std::move(read_sf));
+						sfp = &retry_cache.back();
+					}
+				}
 			}
 
+			serial_feature &sf = *sfp;
+
 			if (gamma > 0) {
 				if (manage_gap(sf.index, &previndex, scale, gamma, &gap)) {
 					continue;
@@ -1577,16 +1851,35 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			fraction_accum -= 1;
 
 			bool reduced = false;
+			drawvec reduced_geometry;
+			drawvec *geometry = &sf.geometry;
 			if (sf.t == VT_POLYGON) {
 				if (!prevent[P_TINY_POLYGON_REDUCTION] && !additional[A_GRID_LOW_ZOOMS]) {
-					sf.geometry = reduce_tiny_poly(sf.geometry, z, line_detail, &reduced, &accum_area);
+					// Into a copy, because the cached feature may be needed again
+					reduced_geometry = reduce_tiny_poly(sf.geometry, z, line_detail, &reduced, &accum_area);
+					geometry = &reduced_geometry;
 				}
 				has_polygons = true;
 			}
 
-			if (sf.geometry.size() > 0) {
+			if (geometry->size() > 0) {
+				units += geometry->size() + sf.keys.size() + sf.full_keys.size();
+
 				partial p;
-				p.geoms.push_back(sf.geometry);
+				if (sfp == &read_sf) {
+					// Not cached for a retry, so the partial can take over the feature's contents
+					p.geoms.push_back(std::move(*geometry));
+					p.keys = std::move(sf.keys);
+					p.values = std::move(sf.values);
+					p.full_keys = std::move(sf.full_keys);
+					p.full_values = std::move(sf.full_values);
+				} else {
+					p.geoms.push_back(*geometry);
+					p.keys = sf.keys;
+					p.values = sf.values;
+					p.full_keys = sf.full_keys;
+					p.full_values = sf.full_values;
+				}
 				p.layer = sf.layer;
 				p.m = sf.m;
 				p.t = sf.t;
@@ -1596,10 +1889,6 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				p.z = z;
 				p.line_detail = line_detail;
 				p.maxzoom = maxzoom;
-				p.keys = sf.keys;
-				p.values = sf.values;
-				p.full_keys = sf.full_keys;
-				p.full_values = sf.full_values;
 				p.spacing = spacing;
 				p.simplification = simplification;
 				p.id = sf.id;
@@ -1607,13 +1896,43 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				p.index2 = merge_previndex;
 				p.index = sf.index;
 				p.renamed = -1;
-				partials.push_back(p);
+				partials.push_back(std::move(p));
+
+				if (sf.t != VT_POINT) {
+					points_only = false;
+				}
 			}
 
 			merge_previndex = sf.index;
 		}
 
-		if (prefilter != NULL) {
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - read_start).count();
+		if (retry_cached) {
+			if (pthread_mutex_lock(&var_lock) != 0) {
+				perror("pthread_mutex_lock");
+				exit(EXIT_FAILURE);
+			}
+
+			cached_retries++;
+			if (read_seconds > elapsed) {
+				retry_seconds_saved += read_seconds - elapsed;
+			}
+
+			if (pthread_mutex_unlock(&var_lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_FAILURE);
+			}
+		} else if (retry_caching) {
+			retry_cached = true;
+			read_seconds = elapsed;
+			cached_original_features = original_features;
+			cached_unclipped_features = unclipped_features;
+		}
+
+		if (prefilter_process != NULL) {
+			threadpool_join(&prefilter_writer);
+			release_filter(prefilter_process);
+		} else if (prefilter != NULL) {
 			json_end(prefilter_jp);
 			if (fclose(prefilter_read_fp) != 0) {
 				perror("close output from prefilter");
@@ -1629,50 +1948,134 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					break;
 				}
 			}
-			void *ret;
-			if (pthread_join(prefilter_writer, &ret) != 0) {
-				perror("pthread_join prefilter writer");
-				exit(EXIT_FAILURE);
-			}
+			threadpool_join(&prefilter_writer);
 		}
 
 		first_time = false;
+
+		for (int j = 0; j < child_shards; j++) {
+			if (within[j]) {
+				serialize_byte(geomfile[j], -2, &geompos[j], fname);
+				within[j] = 0;
+
+				// Remember where the child tile starts in its shard so that
+				// the next zoom can divide the shard at tile boundaries.
+				arg->geomfile_tiles[j].push_back(arg->geomfile_pos[j]);
+				arg->geomfile_pos[j] += geompos[j];
+			}
+		}
+
+		// Before the first encoding, guess from the tiles that have already been made
+		// whether this one will be too big, and if so, start out dropping about as much
+		// as the retries would have converged on. The real compressed size still
+		// decides whether the tile fits.
+		if (!predicted) {
+			predicted = true;
+			double estimate = predict_tile_size(z, units);
+
+			if (estimate > max_tile_size) {
+				double ratio = max_tile_size / estimate;
+				bool adjusted = false;
+
+				if (additional[A_DROP_DENSEST_AS_NEEDED]) {
+					mingap_fraction = mingap_fraction * ratio * 0.90;
+					unsigned long long mg = choose_mingap(indices, mingap_fraction);
+					if (mg <= mingap) {
+						mg = mingap * 1.5;
+					}
+					mingap = mg;
+					if (mingap > arg->mingap_out) {
+						arg->mingap_out = mingap;
+						arg->still_dropping = true;
+					}
+					adjusted = true;
+				} else if (additional[A_DROP_SMALLEST_AS_NEEDED]) {
+					minextent_fraction = minextent_fraction * ratio * 0.90;
+					long long m = choose_minextent(extents, minextent_fraction);
+					if (m != minextent) {
+						minextent = m;
+						if (minextent > arg->minextent_out) {
+							arg->minextent_out = minextent;
+							arg->still_dropping = true;
+						}
+						adjusted = true;
+					}
+				} else if (prevent[P_DYNAMIC_DROP] || additional[A_DROP_FRACTION_AS_NEEDED]) {
+					fraction = fraction * ratio * 0.95;
+					if (additional[A_DROP_FRACTION_AS_NEEDED] && fraction < arg->fraction_out) {
+						arg->fraction_out = fraction;
+						arg->still_dropping = true;
+					}
+					adjusted = true;
+				}
+
+				if (adjusted) {
+					if (!quiet) {
+						fprintf(stderr, "tile %d/%u/%u is predicted to be %.0f bytes, >%zu    \n", z, tx, ty, estimate, max_tile_size);
+					}
+
+					// Not a retry, since nothing was encoded
+					retries--;
+					line_detail++;
+					continue;
+				}
+			}
+		}
+
 		bool merge_successful = true;
 
 		if (additional[A_DETECT_SHARED_BORDERS] || (additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction < 1)) {
 			merge_successful = find_common_edges(partials, z, line_detail, simplification, maxzoom, merge_fraction);
 		}
 
-		int tasks = ceil((double) CPUS / *running);
-		if (tasks < 1) {
-			tasks = 1;
-		}
+		if (points_only) {
+			// Points need no simplification or cleaning, so there is nothing
+			// worth handing out to other threads. Just scale them into the tile.
+			for (size_t i = 0; i < partials.size(); i++) {
+				drawvec &geom = partials[i].geoms[0];
+
+				if (additional[A_GRID_LOW_ZOOMS] && z < maxzoom) {
+					geom = stairstep(geom, z, line_detail);
+				}
 
-		pthread_t pthreads[tasks];
-		partial_arg args[tasks];
-		for (int i = 0; i < tasks; i++) {
-			args[i].task = i;
-			args[i].tasks = tasks;
-			args[i].partials = &partials;
+				to_tile_scale(geom, z, line_detail);
 
-			if (tasks > 1) {
-				if (pthread_create(&pthreads[i], NULL, partial_feature_worker, &args[i]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
+				if (geom.size() > 0) {
+					partials[i].index = encode(geom[0].x, geom[0].y);
+					partials[i].index2 = encode(geom[geom.size() - 1].x, geom[geom.size() - 1].y);
+
+					if (partials[i].index2 < partials[i].index) {
+						partials[i].index2 = ~0LL;
+					}
+				} else {
+					partials[i].index = 0;
+					partials[i].index2 = 0;
 				}
-			} else {
-				partial_feature_worker(&args[i]);
 			}
-		}
+		} else {
+			int tasks = ceil((double) CPUS / *running);
+			if (tasks < 1) {
+				tasks = 1;
+			}
 
-		if (tasks > 1) {
+			job jobs[tasks];
+			partial_arg args[tasks];
 			for (int i = 0; i < tasks; i++) {
-				void *retval;
+				args[i].task = i;
+				args[i].tasks = tasks;
+				args[i].partials = &partials;
 
-				if (pthread_join(pthreads[i], &retval) != 0) {
-					perror("pthread_join");
+				// The first share of the work is done on this thread
+				if (i > 0) {
+					threadpool_start(&jobs[i], partial_feature_worker, &args[i]);
 				}
 			}
+
+			partial_feature_worker(&args[0]);
+
+			for (int i = 1; i < tasks; i++) {
+				threadpool_join(&jobs[i]);
+			}
 		}
 
 		for (size_t i = 0; i < partials.size(); i++) {
@@ -1689,16 +2092,23 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 					c.type = t;
 					c.index = partials[i].index;
 					c.index2 = partials[i].index2;
-					c.geom = pgeoms[j];
-					pgeoms[j].clear();
+					c.geom = std::move(pgeoms[j]);
 					c.coalesced = false;
 					c.original_seq = original_seq;
 					c.m = partials[i].m;
 					c.stringpool = stringpool + pool_off[partials[i].segment];
-					c.keys = partials[i].keys;
-					c.values = partials[i].values;
-					c.full_keys = partials[i].full_keys;
-					c.full_values = partials[i].full_values;
+					if (j + 1 < pgeoms.size()) {
+						c.keys = partials[i].keys;
+						c.values = partials[i].values;
+						c.full_keys = partials[i].full_keys;
+						c.full_values = partials[i].full_values;
+					} else {
+						// The last piece can take the attributes instead of copying them
+						c.keys = std::move(partials[i].keys);
+						c.values = std::move(partials[i].values);
+						c.full_keys = std::move(partials[i].full_keys);
+						c.full_values = std::move(partials[i].full_values);
+					}
 					c.spacing = partials[i].spacing;
 					c.id = partials[i].id;
 					c.has_id = partials[i].has_id;
@@ -1717,21 +2127,13 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 						fprintf(stderr, "layer %lld\n", partials[i].layer);
 						exit(EXIT_FAILURE);
 					}
-					l->second.push_back(c);
+					l->second.push_back(std::move(c));
 				}
 			}
 		}
 
 		partials.clear();
 
-		int j;
-		for (j = 0; j < child_shards; j++) {
-			if (within[j]) {
-				serialize_byte(geomfile[j], -2, &geompos[j], fname);
-				within[j] = 0;
-			}
-		}
-
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
 			std::vector<coalesce> &layer_features = layer_iterator->second;
 
@@ -1739,52 +2141,55 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				std::sort(layer_features.begin(), layer_features.end());
 			}
 
-			std::vector<coalesce> out;
-			if (layer_features.size() > 0) {
-				out.push_back(layer_features[0]);
-			}
-			for (size_t x = 1; x < layer_features.size(); x++) {
-				size_t y = out.size() - 1;
+			// Points are never coalesced and need no cleaning
+			if (!points_only) {
+				std::vector<coalesce> out;
+				if (layer_features.size() > 0) {
+					out.push_back(layer_features[0]);
+				}
+				for (size_t x = 1; x < layer_features.size(); x++) {
+					size_t y = out.size() - 1;
 
 #if 0
-				if (out.size() > 0 && coalcmp(&layer_features[x], &out[y]) < 0) {
-					fprintf(stderr, "\nfeature out of order\n");
-				}
+					if (out.size() > 0 && coalcmp(&layer_features[x], &out[y]) < 0) {
+						fprintf(stderr, "\nfeature out of order\n");
+					}
 #endif
 
-				if (additional[A_COALESCE] && out.size() > 0 && out[y].geom.size() + layer_features[x].geom.size() < 700 && coalcmp(&layer_features[x], &out[y]) == 0 && layer_features[x].type != VT_POINT) {
-					for (size_t g = 0; g < layer_features[x].geom.size(); g++) {
-						out[y].geom.push_back(layer_features[x].geom[g]);
+					if (additional[A_COALESCE] && out.size() > 0 && out[y].geom.size() + layer_features[x].geom.size() < 700 && coalcmp(&layer_features[x], &out[y]) == 0 && layer_features[x].type != VT_POINT) {
+						for (size_t g = 0; g < layer_features[x].geom.size(); g++) {
+							out[y].geom.push_back(layer_features[x].geom[g]);
+						}
+						out[y].coalesced = true;
+					} else {
+						out.push_back(layer_features[x]);
 					}
-					out[y].coalesced = true;
-				} else {
-					out.push_back(layer_features[x]);
 				}
-			}
 
-			layer_features = out;
-
-			out.clear();
-			for (size_t x = 0; x < layer_features.size(); x++) {
-				if (layer_features[x].coalesced && layer_features[x].type == VT_LINE) {
-					layer_features[x].geom = remove_noop(layer_features[x].geom, layer_features[x].type, 0);
-					layer_features[x].geom = simplify_lines(layer_features[x].geom, 32, 0,
-										!(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, layer_features[x].type == VT_POLYGON ? 4 : 0);
-				}
+				layer_features = out;
 
-				if (layer_features[x].type == VT_POLYGON) {
-					if (layer_features[x].coalesced) {
-						layer_features[x].geom = clean_or_clip_poly(layer_features[x].geom, 0, 0, 0, false);
+				out.clear();
+				for (size_t x = 0; x < layer_features.size(); x++) {
+					if (layer_features[x].coalesced && layer_features[x].type == VT_LINE) {
+						layer_features[x].geom = remove_noop(layer_features[x].geom, layer_features[x].type, 0);
+						layer_features[x].geom = simplify_lines(layer_features[x].geom, 32, 0,
+											!(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, layer_features[x].type == VT_POLYGON ? 4 : 0, false);
 					}
 
-					layer_features[x].geom = close_poly(layer_features[x].geom);
-				}
+					if (layer_features[x].type == VT_POLYGON) {
+						if (layer_features[x].coalesced) {
+							layer_features[x].geom = clean_or_clip_poly(layer_features[x].geom, 0, 0, 0, false);
+						}
+
+						layer_features[x].geom = close_poly(layer_features[x].geom);
+					}
 
-				if (layer_features[x].geom.size() > 0) {
-					out.push_back(layer_features[x]);
+					if (layer_features[x].geom.size() > 0) {
+						out.push_back(layer_features[x]);
+					}
 				}
+				layer_features = out;
 			}
-			layer_features = out;
 
 			if (prevent[P_INPUT_ORDER]) {
 				std::sort(layer_features.begin(), layer_features.end(), preservecmp);
@@ -1951,10 +2356,22 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 			std::string compressed;
 			std::string pbf = tile.encode();
 
+			// Without a size limit, nothing here needs the compressed size,
+			// so the compression can be left to the tile writer's threads
+			if (prevent[P_KILOBYTE_LIMIT] && !prevent[P_TILE_COMPRESSION] && pass == 1) {
+				tile_writer_put(z, tx, ty, pbf, true);
+				note_retries(z, tx, ty, retries);
+				return count;
+			}
+
 			if (!prevent[P_TILE_COMPRESSION]) {
 				compress(pbf, compressed);
 			} else {
-				compressed = pbf;
+				compressed.swap(pbf);
+			}
+
+			if (additional[A_PREDICT_TILE_SIZES]) {
+				learn_tile_size(z, units, compressed.size());
 			}
 
 			if (compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
@@ -2030,26 +2447,14 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 				}
 			} else {
 				if (pass == 1) {
-					if (pthread_mutex_lock(&db_lock) != 0) {
-						perror("pthread_mutex_lock");
-						exit(EXIT_FAILURE);
-					}
-
-					if (outdb != NULL) {
-						mbtiles_write_tile(outdb, z, tx, ty, compressed.data(), compressed.size());
-					} else if (outdir != NULL) {
-						dir_write_tile(outdir, z, tx, ty, compressed);
-					}
-
-					if (pthread_mutex_unlock(&db_lock) != 0) {
-						perror("pthread_mutex_unlock");
-						exit(EXIT_FAILURE);
-					}
+					tile_writer_put(z, tx, ty, compressed, false);
 				}
 
+				note_retries(z, tx, ty, retries);
 				return count;
 			}
 		} else {
+			note_retries(z, tx, ty, retries);
 			return count;
 		}
 	}
@@ -2058,117 +2463,623 @@ long long write_tile(FILE *geoms, long long *geompos_in, char *metabase, char *s
 	return -1;
 }
 
+// A unit of tiling work: either a whole shard of the previous zoom's output,
+// or (if the shard was big enough to be worth dividing) a run of whole tiles
+// from within it.
 struct task {
 	int fileno;
-	struct task *next;
+	long long start;  // -1 for the whole shard
+	long long end;
+	long long todo;
 };
 
-void *run_thread(void *vargs) {
-	write_tile_args *arg = (write_tile_args *) vargs;
-	struct task *task;
+struct task_queue {
+	std::deque<task> tasks;
+	long long todo;
+};
 
-	for (task = arg->tasks; task != NULL; task = task->next) {
-		int j = task->fileno;
+// Each thread works through its own queue of tasks, and once that is empty
+// steals from the end of whichever other thread's queue has the most left to do.
+struct scheduler {
+	pthread_mutex_t lock;
+	std::vector<task_queue> queues;
+};
 
-		if (arg->geomfd[j] < 0) {
-			// only one source file for zoom level 0
-			continue;
+// Must be called with the scheduler's lock held
+bool take_task(scheduler *sched, size_t thread, task *out) {
+	task_queue *own = &sched->queues[thread];
+
+	if (own->tasks.size() > 0) {
+		*out = own->tasks.front();
+		own->tasks.pop_front();
+		own->todo -= out->todo;
+		return true;
+	}
+
+	task_queue *victim = NULL;
+	for (size_t i = 0; i < sched->queues.size(); i++) {
+		if (sched->queues[i].tasks.size() > 0 && (victim == NULL || sched->queues[i].todo > victim->todo)) {
+			victim = &sched->queues[i];
 		}
-		if (arg->geom_size[j] == 0) {
-			continue;
+	}
+
+	if (victim != NULL) {
+		*out = victim->tasks.back();
+		victim->tasks.pop_back();
+		victim->todo -= out->todo;
+		return true;
+	}
+
+	return false;
+}
+
+bool next_task(scheduler *sched, size_t thread, task *out) {
+	if (pthread_mutex_lock(&sched->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	bool found = take_task(sched, thread, out);
+
+	if (pthread_mutex_unlock(&sched->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return found;
+}
+
+// Divide a shard into runs of whole tiles of about split_size bytes each,
+// using the tile offsets that were recorded while it was being written.
+void split_shard(int j, off_t size, std::vector<long long> const &starts, long long split_size, std::vector<task> &out) {
+	if (starts.size() == 0) {
+		task t;
+		t.fileno = j;
+		t.start = 0;
+		t.end = size;
+		t.todo = size;
+		out.push_back(t);
+		return;
+	}
+
+	for (size_t k = 0; k < starts.size();) {
+		task t;
+		t.fileno = j;
+		t.start = starts[k];
+
+		for (k++; k < starts.size(); k++) {
+			if (starts[k] - t.start >= split_size) {
+				break;
+			}
+		}
+
+		if (k < starts.size()) {
+			t.end = starts[k];
+		} else {
+			t.end = size;
 		}
+		t.todo = t.end - t.start;
+		out.push_back(t);
+	}
+}
 
-		// printf("%lld of geom_size\n", (long long) geom_size[j]);
+char *map_shard(int fd, off_t size) {
+	char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap geom");
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, size, MADV_SEQUENTIAL);  // each task reads its run of tiles front to back
+	return map;
+}
 
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
-			perror("mmap geom");
+void make_shards(const char *tmpdir, FILE **sub, int *subfd) {
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
+		sprintf(geomname, "%s/geom%zu.XXXXXXXX", tmpdir, j);
+		subfd[j] = mkstemp_cloexec(geomname);
+		// printf("%s\n", geomname);
+		if (subfd[j] < 0) {
+			perror(geomname);
+			exit(EXIT_FAILURE);
+		}
+		sub[j] = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+		if (sub[j] == NULL) {
+			perror(geomname);
 			exit(EXIT_FAILURE);
 		}
+		unlink(geomname);
+	}
+}
 
-		long long geompos = 0;
-		long long prevgeom = 0;
+// Returns false, with arg->err set, if a tile could not be made small enough
+bool run_task(write_tile_args *arg, task const &t) {
+	int j = t.fileno;
 
-		while (1) {
-			int z;
-			unsigned x, y;
+	if (arg->geomfd[j] < 0) {
+		// only one source file for zoom level 0
+		return true;
+	}
+	if (arg->geom_size[j] == 0) {
+		return true;
+	}
 
-			if (!deserialize_int_io(geom, &z, &geompos)) {
-				break;
-			}
-			deserialize_uint_io(geom, &x, &geompos);
-			deserialize_uint_io(geom, &y, &geompos);
+	// printf("%lld of geom_size\n", (long long) geom_size[j]);
 
-			arg->wrote_zoom = z;
+	FILE *geom;
+	if (t.start < 0) {
+		geom = fdopen(arg->geomfd[j], "rb");
+	} else {
+		geom = fmemopen(arg->geom_map[j] + t.start, t.end - t.start, "rb");
+	}
+	if (geom == NULL) {
+		perror("mmap geom");
+		exit(EXIT_FAILURE);
+	}
 
-			// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+	long long geompos = 0;
+	long long prevgeom = 0;
 
-			long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->basezoom, arg->outdb, arg->outdir, arg->droprate, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
+	while (1) {
+		int z;
+		unsigned x, y;
 
-			if (len < 0) {
-				int *err = &arg->err;
-				*err = z - 1;
-				return err;
-			}
+		if (!deserialize_int_io(geom, &z, &geompos)) {
+			break;
+		}
+		deserialize_uint_io(geom, &x, &geompos);
+		deserialize_uint_io(geom, &y, &geompos);
 
-			if (pthread_mutex_lock(&var_lock) != 0) {
-				perror("pthread_mutex_lock");
-				exit(EXIT_FAILURE);
-			}
+		if (arg->stop_zoom != NULL && z > *arg->stop_zoom) {
+			break;
+		}
+
+		arg->wrote_zoom = z;
+
+		// fprintf(stderr, "%d/%u/%u\n", z, x, y);
+
+		long long len = write_tile(geom, &geompos, arg->metabase, arg->stringpool, z, x, y, z == arg->maxzoom ? arg->full_detail : arg->low_detail, arg->min_detail, arg->basezoom, arg->outdb, arg->outdir, arg->droprate, arg->buffer, arg->fname, arg->geomfile, arg->minzoom, arg->maxzoom, arg->todo, arg->along, geompos, arg->gamma, arg->child_shards, arg->meta_off, arg->pool_off, arg->initial_x, arg->initial_y, arg->running, arg->simplification, arg->layermaps, arg->layer_unmaps, arg->tiling_seg, arg->pass, arg->passes, arg->mingap, arg->minextent, arg->fraction, arg->prefilter, arg->postfilter, arg);
+
+		if (len < 0) {
+			arg->err = z - 1;
+			return false;
+		}
+
+		if (pthread_mutex_lock(&var_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+
+		if (z == arg->maxzoom) {
+			if (len > *arg->most) {
+				*arg->midx = x;
+				*arg->midy = y;
+				*arg->most = len;
+			} else if (len == *arg->most) {
+				unsigned long long a = (((unsigned long long) x) << 32) | y;
+				unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
 
-			if (z == arg->maxzoom) {
-				if (len > *arg->most) {
+				if (a < b) {
 					*arg->midx = x;
 					*arg->midy = y;
 					*arg->most = len;
-				} else if (len == *arg->most) {
-					unsigned long long a = (((unsigned long long) x) << 32) | y;
-					unsigned long long b = (((unsigned long long) *arg->midx) << 32) | *arg->midy;
-
-					if (a < b) {
-						*arg->midx = x;
-						*arg->midy = y;
-						*arg->most = len;
-					}
 				}
 			}
+		}
 
-			*arg->along += geompos - prevgeom;
-			prevgeom = geompos;
+		*arg->along += geompos - prevgeom;
+		prevgeom = geompos;
 
-			if (pthread_mutex_unlock(&var_lock) != 0) {
-				perror("pthread_mutex_unlock");
+		if (pthread_mutex_unlock(&var_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (t.start >= 0) {
+		// The shard stays open and mapped until the end of the zoom level
+	} else if (arg->pass == 1) {
+		// Since the fclose() has closed the underlying file descriptor
+		arg->geomfd[j] = -1;
+	} else {
+		int newfd = dup(arg->geomfd[j]);
+		if (newfd < 0) {
+			perror("dup geometry");
+			exit(EXIT_FAILURE);
+		}
+		if (lseek(newfd, 0, SEEK_SET) < 0) {
+			perror("lseek geometry");
+			exit(EXIT_FAILURE);
+		}
+		arg->geomfd[j] = newfd;
+	}
+
+	if (fclose(geom) != 0) {
+		perror("close geom");
+		exit(EXIT_FAILURE);
+	}
+
+	return true;
+}
+
+void *run_thread(void *vargs) {
+	write_tile_args *arg = (write_tile_args *) vargs;
+	task t;
+
+	while (next_task(arg->sched, arg->thread, &t)) {
+		if (!run_task(arg, t)) {
+			return &arg->err;
+		}
+	}
+
+	arg->running--;
+	return NULL;
+}
+
+// When zoom levels are pipelined, each generation of tiles is a stage:
+// the shards it reads, which are the output of the previous stage,
+// and the shards it writes for the next one. A thread that runs out of
+// work in one stage moves on to tiles of the next zoom level as soon as
+// all of the shards it owns are complete, instead of waiting for the
+// slowest thread to finish the whole zoom level.
+struct stage {
+	int z;
+
+	std::vector<int> geomfd;
+	std::vector<off_t> geom_size;
+	std::vector<char *> geom_map;
+
+	std::vector<FILE *> sub;
+	std::vector<int> subfd;
+	std::vector<long long> sub_pos;
+	std::vector<std::vector<long long>> sub_tiles;
+
+	scheduler sched;
+	size_t producers;  // threads still writing shards that this stage reads
+	size_t finished;   // threads that are done reading this stage's shards
+	size_t tasks;
+	long long todo;
+	long long along;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<stage *> stages;
+	size_t threads;
+	size_t stop;  // no tiles are made at or beyond this stage after an error
+	volatile int err;  // the last complete zoom level, after an error
+	int maxzoom;
+	const char *tmpdir;
+};
+
+struct pipeline_args {
+	pipeline *p;
+	write_tile_args arg;
+};
+
+stage *new_stage(pipeline *p, int z) {
+	stage *s = new stage;
+
+	s->z = z;
+	s->geomfd.resize(TEMP_FILES, -1);
+	s->geom_size.resize(TEMP_FILES, 0);
+	s->geom_map.resize(TEMP_FILES, NULL);
+	s->sub.resize(TEMP_FILES, NULL);
+	s->subfd.resize(TEMP_FILES, -1);
+	s->sub_pos.resize(TEMP_FILES, 0);
+	s->sub_tiles.resize(TEMP_FILES);
+
+	pthread_mutex_init(&s->sched.lock, NULL);
+	s->sched.queues.resize(p->threads);
+	for (size_t thread = 0; thread < p->threads; thread++) {
+		s->sched.queues[thread].todo = 0;
+	}
+
+	s->producers = p->threads;
+	s->finished = 0;
+	s->tasks = 0;
+	s->todo = 0;
+	s->along = 0;
+
+	if (z < p->maxzoom) {
+		make_shards(p->tmpdir, s->sub.data(), s->subfd.data());
+	}
+
+	return s;
+}
+
+// Unmap and close the shards that a stage was reading
+void close_stage_inputs(stage *s) {
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		if (s->geom_map[j] != NULL) {
+			if (munmap(s->geom_map[j], s->geom_size[j]) != 0) {
+				perror("munmap geom");
+				exit(EXIT_FAILURE);
+			}
+			s->geom_map[j] = NULL;
+		}
+		if (s->geomfd[j] >= 0) {
+			if (close(s->geomfd[j]) != 0) {
+				perror("close geom");
 				exit(EXIT_FAILURE);
 			}
+			s->geomfd[j] = -1;
 		}
+	}
+}
 
-		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
-		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
+// Hand the shards that one thread wrote during stage s to the next stage,
+// as tasks in that thread's own queue. Must be called with the pipeline lock held.
+void pass_shards(stage *s, stage *n, size_t thread, size_t first, size_t count, size_t threads) {
+	long long split_size = s->todo / (threads * 4);
+	std::vector<task> tasks;
+
+	for (size_t j = first; j < first + count; j++) {
+		n->geomfd[j] = s->subfd[j];
+		s->subfd[j] = -1;
+
+		if (n->geom_size[j] > 0) {
+			n->geom_map[j] = map_shard(n->geomfd[j], n->geom_size[j]);
+			split_shard(j, n->geom_size[j], s->sub_tiles[j], split_size, tasks);
+			n->todo += n->geom_size[j];
+		}
+
+		std::vector<long long>().swap(s->sub_tiles[j]);
+	}
+
+	for (size_t k = 0; k < tasks.size(); k++) {
+		n->sched.queues[thread].tasks.push_back(tasks[k]);
+		n->sched.queues[thread].todo += tasks[k].todo;
+	}
+	n->tasks += tasks.size();
+}
+
+void pipeline_lock(pipeline *p) {
+	if (pthread_mutex_lock(&p->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void pipeline_unlock(pipeline *p) {
+	if (pthread_mutex_unlock(&p->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void *run_pipeline_thread(void *vargs) {
+	pipeline_args *pa = (pipeline_args *) vargs;
+	pipeline *p = pa->p;
+	write_tile_args *arg = &pa->arg;
+
+	size_t child_shards = TEMP_FILES / p->threads;
+	size_t first = arg->thread * child_shards;
+
+	pipeline_lock(p);
+
+	for (size_t g = 0;; g++) {
+		// The stage exists: it was created by the first thread
+		// to finish with the one before it.
+		stage *s = p->stages[g];
+
+		arg->sched = &s->sched;
+		arg->geomfd = s->geomfd.data();
+		arg->geom_size = s->geom_size.data();
+		arg->geom_map = s->geom_map.data();
+		arg->geomfile = s->sub.data() + first;
+		arg->geomfile_pos = s->sub_pos.data() + first;
+		arg->geomfile_tiles = s->sub_tiles.data() + first;
+		arg->along = &s->along;
+
+		while (true) {
+			task t;
+			bool found = false;
+
+			while (g < p->stop) {
+				if (take_task(&s->sched, arg->thread, &t)) {
+					found = true;
+					break;
+				}
+				if (s->producers == 0) {
+					break;
+				}
+				pthread_cond_wait(&p->cond, &p->lock);
+			}
+
+			if (g >= p->stop) {
+				(*arg->running)--;
+				pipeline_unlock(p);
+				return NULL;
+			}
+			if (!found) {
+				break;
+			}
+
+			// Tasks from this thread's own shards arrive before those
+			// of slower threads, so the total can still be growing.
+			arg->todo = s->todo;
+			pipeline_unlock(p);
+
+			bool ok = run_task(arg, t);
+
+			pipeline_lock(p);
+			if (!ok) {
+				if (arg->err < p->err) {
+					p->err = arg->err;
+				}
+				if (g < p->stop) {
+					p->stop = g;
+				}
+				(*arg->running)--;
+				pthread_cond_broadcast(&p->cond);
+				pipeline_unlock(p);
+				return NULL;
+			}
+		}
+
+		// No more tiles will arrive for this stage, so the shards that this
+		// thread was writing for the next zoom level are complete.
+
+		if (s->z >= p->maxzoom || s->tasks == 0) {
+			s->finished++;
+			(*arg->running)--;
+			pthread_cond_broadcast(&p->cond);
+			pipeline_unlock(p);
+			return NULL;
+		}
+
+		pipeline_unlock(p);
+
+		std::vector<off_t> sizes;
+		for (size_t j = first; j < first + child_shards; j++) {
+			if (fclose(s->sub[j]) != 0) {
+				perror("close subfile");
 				exit(EXIT_FAILURE);
 			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
+			s->sub[j] = NULL;
+
+			struct stat geomst;
+			if (fstat(s->subfd[j], &geomst) != 0) {
+				perror("stat geom\n");
 				exit(EXIT_FAILURE);
 			}
-			arg->geomfd[j] = newfd;
+			sizes.push_back(geomst.st_size);
 		}
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
-			exit(EXIT_FAILURE);
+		pipeline_lock(p);
+
+		if (g + 1 == p->stages.size()) {
+			p->stages.push_back(new_stage(p, s->z + 1));
+		}
+		stage *n = p->stages[g + 1];
+
+		for (size_t j = first; j < first + child_shards; j++) {
+			n->geom_size[j] = sizes[j - first];
+		}
+		pass_shards(s, n, arg->thread, first, child_shards, p->threads);
+
+		s->finished++;
+		if (s->finished == p->threads) {
+			close_stage_inputs(s);
 		}
+		n->producers--;
+
+		pthread_cond_broadcast(&p->cond);
 	}
+}
 
-	arg->running--;
-	return NULL;
+// Tile zoom levels z through maxzoom, letting threads start on the next zoom
+// level while others are still finishing the current one. Returns the
+// last zoom level that was completed.
+int pipeline_zooms(int z, int *geomfd, off_t *geom_size, std::vector<std::vector<long long>> &geom_tiles, write_tile_args const &common, size_t threads, const char *tmpdir) {
+	pipeline p;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	p.threads = threads;
+	p.stop = SIZE_MAX;
+	p.err = INT_MAX;
+	p.maxzoom = common.maxzoom;
+	p.tmpdir = tmpdir;
+
+	// The first stage reads the shards from the previous zoom level,
+	// or the single sorted input file for z0.
+	stage *s = new_stage(&p, z);
+	s->producers = 0;
+
+	std::vector<task> all_tasks;
+	long long todo = 0;
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		todo += geom_size[j];
+	}
+
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		s->geomfd[j] = geomfd[j];
+		s->geom_size[j] = geom_size[j];
+		geomfd[j] = -1;
+
+		if (s->geom_size[j] > 0) {
+			s->geom_map[j] = map_shard(s->geomfd[j], s->geom_size[j]);
+			split_shard(j, s->geom_size[j], geom_tiles[j], todo / (threads * 4), all_tasks);
+		}
+	}
+
+	for (size_t k = 0; k < all_tasks.size(); k++) {
+		size_t least = 0;
+		for (size_t thread = 1; thread < threads; thread++) {
+			if (s->sched.queues[thread].todo < s->sched.queues[least].todo) {
+				least = thread;
+			}
+		}
+
+		s->sched.queues[least].tasks.push_back(all_tasks[k]);
+		s->sched.queues[least].todo += all_tasks[k].todo;
+	}
+	s->tasks = all_tasks.size();
+	s->todo = todo;
+	p.stages.push_back(s);
+
+	job jobs[threads];
+	pipeline_args args[threads];
+	int running = threads;
+	long long most = 0;
+
+	for (size_t thread = 0; thread < threads; thread++) {
+		args[thread].p = &p;
+		args[thread].arg = common;
+		args[thread].arg.thread = thread;
+		args[thread].arg.child_shards = TEMP_FILES / threads;
+		args[thread].arg.most = &most;  // locked with var_lock
+		args[thread].arg.tiling_seg += thread;
+		args[thread].arg.running = &running;
+		args[thread].arg.err = INT_MAX;
+		args[thread].arg.stop_zoom = &p.err;
+
+		threadpool_start(&jobs[thread], run_pipeline_thread, &args[thread]);
+	}
+
+	for (size_t thread = 0; thread < threads; thread++) {
+		threadpool_join(&jobs[thread]);
+	}
+
+	for (size_t g = 0; g < p.stages.size(); g++) {
+		stage *st = p.stages[g];
+
+		close_stage_inputs(st);
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			if (st->sub[j] != NULL) {
+				if (fclose(st->sub[j]) != 0) {
+					perror("close subfile");
+					exit(EXIT_FAILURE);
+				}
+			}
+			if (st->subfd[j] >= 0) {
+				if (close(st->subfd[j]) != 0) {
+					perror("close geom");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+
+		pthread_mutex_destroy(&st->sched.lock);
+		delete st;
+	}
+
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+
+	if (p.err != INT_MAX) {
+		return p.err;
+	}
+
+	if (!quiet) {
+		fprintf(stderr, "\n");
+	}
+	return common.maxzoom;
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter) {
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, unsigned *midx, unsigned *midy, int &maxzoom, int minzoom, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, feature_filter const *filter) {
 	// The existing layermaps are one table per input thread.
 	// We need to add another one per *tiling* thread so that it can be
 	// safely changed during tiling.
@@ -2190,47 +3101,156 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
+	// Offsets of the tiles within each shard of the current zoom level.
+	// Nothing is known about the single sorted input file for z0.
+	std::vector<std::vector<long long>> geom_tiles(TEMP_FILES);
+
+	write_tile_args common;
+	common.metabase = metabase;
+	common.stringpool = stringpool;
+	common.min_detail = min_detail;
+	common.basezoom = basezoom;
+	common.outdb = outdb;  // only used by the tile writer
+	common.outdir = outdir;
+	common.droprate = droprate;
+	common.buffer = buffer;
+	common.fname = fname;
+	common.gamma = gamma;
+	common.gamma_out = gamma;
+	common.mingap = 0;
+	common.mingap_out = 0;
+	common.minextent = 0;
+	common.minextent_out = 0;
+	common.fraction = 1;
+	common.fraction_out = 1;
+	common.simplification = simplification;
+	common.midx = midx;  // locked with var_lock
+	common.midy = midy;  // locked with var_lock
+	common.maxzoom = maxzoom;
+	common.minzoom = minzoom;
+	common.full_detail = full_detail;
+	common.low_detail = low_detail;
+	common.meta_off = meta_off;
+	common.pool_off = pool_off;
+	common.initial_x = initial_x;
+	common.initial_y = initial_y;
+	common.layermaps = &layermaps;
+	common.layer_unmaps = &layer_unmaps;
+	common.tiling_seg = layermaps_off;
+	common.prefilter = prefilter;
+	common.filter = filter;
+	common.postfilter = postfilter;
+	common.pass = 1;
+	common.passes = 1;
+	common.wrote_zoom = -1;
+	common.still_dropping = false;
+	common.retry_cache_limit = physical_memory() / 8 / CPUS;
+
+	// Tiles are compressed in the tiling threads when the size limit needs to know
+	// how big they are, so only start compression threads when it doesn't.
+	size_t compressors = 0;
+	if (prevent[P_KILOBYTE_LIMIT] && !prevent[P_TILE_COMPRESSION]) {
+		compressors = CPUS;
+	}
+	tile_writer_start(outdb, outdir, compressors, 16 * CPUS);
+
+	// Zoom levels can only overlap if each one is tiled in a single pass,
+	// the maxzoom is fixed in advance, and there are enough file descriptors.
+	// While a zoom level is pipelined, its input shards are open, and so are
+	// the output shards of both it and the next zoom level, each of which
+	// takes a file descriptor and a FILE *.
+	bool pipelined = !prevent[P_ZOOM_PIPELINING] && !additional[A_EXTEND_ZOOMS];
+	if (additional[A_INCREASE_GAMMA_AS_NEEDED] || additional[A_DROP_DENSEST_AS_NEEDED] || additional[A_DROP_FRACTION_AS_NEEDED] || additional[A_DROP_SMALLEST_AS_NEEDED]) {
+		pipelined = false;
+	}
+	if (pipelined && 5 * (long long) TEMP_FILES + 10 > MAX_FILES) {
+		if (!quiet) {
+			fprintf(stderr, "Not pipelining zoom levels: %zu temporary files would need %lld file descriptors, but only %lld are available. Raise the limit with \"ulimit -n\" to pipeline.\n", TEMP_FILES, 5 * (long long) TEMP_FILES + 10, MAX_FILES);
+		}
+		pipelined = false;
+	}
+
 	int i;
 	for (i = 0; i <= maxzoom; i++) {
 		long long most = 0;
 
-		FILE *sub[TEMP_FILES];
-		int subfd[TEMP_FILES];
-		for (size_t j = 0; j < TEMP_FILES; j++) {
-			char geomname[strlen(tmpdir) + strlen("/geom.XXXXXXXX" XSTRINGIFY(INT_MAX)) + 1];
-			sprintf(geomname, "%s/geom%zu.XXXXXXXX", tmpdir, j);
-			subfd[j] = mkstemp_cloexec(geomname);
-			// printf("%s\n", geomname);
-			if (subfd[j] < 0) {
-				perror(geomname);
-				exit(EXIT_FAILURE);
+		// Once zoom levels are no longer being skipped to reach the minzoom,
+		// the tiles of each zoom level depend only on their parents.
+		if (pipelined && i + 1 >= minzoom) {
+			size_t threads = CPUS;
+			if (threads > TEMP_FILES / 4) {
+				threads = TEMP_FILES / 4;
 			}
-			sub[j] = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
-			if (sub[j] == NULL) {
-				perror(geomname);
-				exit(EXIT_FAILURE);
+			for (size_t e = 1; e <= threads; e *= 2) {
+				if (e * 2 > threads) {
+					threads = e;
+					break;
+				}
 			}
-			unlink(geomname);
+
+			int ret = pipeline_zooms(i, geomfd, geom_size, geom_tiles, common, threads, tmpdir);
+			tile_writer_finish();
+
+			// Tiles of deeper zoom levels may have been written before the error
+			if (ret < maxzoom) {
+				if (outdb != NULL) {
+					mbtiles_erase_zooms(outdb, ret);
+				} else if (outdir != NULL) {
+					dir_erase_zooms(outdir, ret);
+				}
+			}
+			report_retries();
+			return ret;
 		}
 
-		size_t useful_threads = 0;
+		FILE *sub[TEMP_FILES];
+		int subfd[TEMP_FILES];
+		make_shards(tmpdir, sub, subfd);
+
 		long long todo = 0;
 		for (size_t j = 0; j < TEMP_FILES; j++) {
 			todo += geom_size[j];
-			if (geom_size[j] > 0) {
-				useful_threads++;
-			}
 		}
 
 		size_t threads = CPUS;
 		if (threads > TEMP_FILES / 4) {
 			threads = TEMP_FILES / 4;
 		}
+
+		// Divide up any shard that is much bigger than its share of the work
+		// into runs of whole tiles, using the tile boundaries that were recorded
+		// while it was being written, so that a single dense shard doesn't keep
+		// one thread busy after all the others have finished.
+
+		std::vector<task> all_tasks;
+		char *geom_map[TEMP_FILES];
+		long long split_size = todo / (threads * 4);
+
+		for (size_t j = 0; j < TEMP_FILES; j++) {
+			geom_map[j] = NULL;
+
+			if (geom_size[j] == 0) {
+				continue;
+			}
+
+			if (geom_size[j] > split_size && geom_tiles[j].size() > 1) {
+				geom_map[j] = map_shard(geomfd[j], geom_size[j]);
+				split_shard(j, geom_size[j], geom_tiles[j], split_size, all_tasks);
+			} else {
+				task t;
+				t.fileno = j;
+				t.start = -1;
+				t.end = -1;
+				t.todo = geom_size[j];
+				all_tasks.push_back(t);
+			}
+		}
+
 		// XXX is it useful to divide further if we know we are skipping
 		// some zoom levels? Is it faster to have fewer CPUs working on
 		// sharding, but more deeply, or fewer CPUs, less deeply?
-		if (threads > useful_threads) {
-			threads = useful_threads;
+		if (threads > all_tasks.size()) {
+			threads = all_tasks.size();
 		}
 
 		// Round down to a power of 2
@@ -2244,47 +3264,10 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			threads = 1U << 30;
 		}
 
-		// Assign temporary files to threads
-
-		struct task tasks[TEMP_FILES];
-		struct dispatch {
-			struct task *tasks;
-			long long todo;
-			struct dispatch *next;
-		} dispatches[threads];
-		struct dispatch *dispatch_head = &dispatches[0];
-		for (size_t j = 0; j < threads; j++) {
-			dispatches[j].tasks = NULL;
-			dispatches[j].todo = 0;
-			if (j + 1 < threads) {
-				dispatches[j].next = &dispatches[j + 1];
-			} else {
-				dispatches[j].next = NULL;
-			}
-		}
-
+		std::vector<std::vector<long long>> sub_tiles(TEMP_FILES);
+		long long sub_pos[TEMP_FILES];
 		for (size_t j = 0; j < TEMP_FILES; j++) {
-			if (geom_size[j] == 0) {
-				continue;
-			}
-
-			tasks[j].fileno = j;
-			tasks[j].next = dispatch_head->tasks;
-			dispatch_head->tasks = &tasks[j];
-			dispatch_head->todo += geom_size[j];
-
-			struct dispatch *here = dispatch_head;
-			dispatch_head = dispatch_head->next;
-
-			dispatch **d;
-			for (d = &dispatch_head; *d != NULL; d = &((*d)->next)) {
-				if (here->todo < (*d)->todo) {
-					break;
-				}
-			}
-
-			here->next = *d;
-			*d = here;
+			sub_pos[j] = 0;
 		}
 
 		int err = INT_MAX;
@@ -2300,21 +3283,35 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		double zoom_fraction = 1;
 
 		for (size_t pass = start; pass < 2; pass++) {
-			pthread_t pthreads[threads];
+			job jobs[threads];
 			write_tile_args args[threads];
 			int running = threads;
 			long long along = 0;
 
+			// Assign the tasks to threads, each to whichever is least loaded so far.
+			// Threads that run out of work will steal from the others.
+
+			scheduler sched;
+			pthread_mutex_init(&sched.lock, NULL);
+			sched.queues.resize(threads);
 			for (size_t thread = 0; thread < threads; thread++) {
-				args[thread].metabase = metabase;
-				args[thread].stringpool = stringpool;
-				args[thread].min_detail = min_detail;
-				args[thread].basezoom = basezoom;
-				args[thread].outdb = outdb;  // locked with db_lock
-				args[thread].outdir = outdir;
-				args[thread].droprate = droprate;
-				args[thread].buffer = buffer;
-				args[thread].fname = fname;
+				sched.queues[thread].todo = 0;
+			}
+
+			for (size_t k = 0; k < all_tasks.size(); k++) {
+				size_t least = 0;
+				for (size_t thread = 1; thread < threads; thread++) {
+					if (sched.queues[thread].todo < sched.queues[least].todo) {
+						least = thread;
+					}
+				}
+
+				sched.queues[least].tasks.push_back(all_tasks[k]);
+				sched.queues[least].todo += all_tasks[k].todo;
+			}
+
+			for (size_t thread = 0; thread < threads; thread++) {
+				args[thread] = common;
 				args[thread].geomfile = sub + thread * (TEMP_FILES / threads);
 				args[thread].todo = todo;
 				args[thread].along = &along;  // locked with var_lock
@@ -2327,46 +3324,26 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].fraction = zoom_fraction;
 				args[thread].fraction_out = zoom_fraction;
 				args[thread].child_shards = TEMP_FILES / threads;
-				args[thread].simplification = simplification;
-
 				args[thread].geomfd = geomfd;
 				args[thread].geom_size = geom_size;
-				args[thread].midx = midx;  // locked with var_lock
-				args[thread].midy = midy;  // locked with var_lock
 				args[thread].maxzoom = maxzoom;
-				args[thread].minzoom = minzoom;
-				args[thread].full_detail = full_detail;
-				args[thread].low_detail = low_detail;
 				args[thread].most = &most;  // locked with var_lock
-				args[thread].meta_off = meta_off;
-				args[thread].pool_off = pool_off;
-				args[thread].initial_x = initial_x;
-				args[thread].initial_y = initial_y;
-				args[thread].layermaps = &layermaps;
-				args[thread].layer_unmaps = &layer_unmaps;
 				args[thread].tiling_seg = thread + layermaps_off;
-				args[thread].prefilter = prefilter;
-				args[thread].postfilter = postfilter;
 
-				args[thread].tasks = dispatches[thread].tasks;
+				args[thread].sched = &sched;
+				args[thread].thread = thread;
+				args[thread].geom_map = geom_map;
+				args[thread].geomfile_pos = sub_pos + thread * (TEMP_FILES / threads);
+				args[thread].geomfile_tiles = sub_tiles.data() + thread * (TEMP_FILES / threads);
 				args[thread].running = &running;
 				args[thread].pass = pass;
 				args[thread].passes = 2 - start;
-				args[thread].wrote_zoom = -1;
-				args[thread].still_dropping = false;
 
-				if (pthread_create(&pthreads[thread], NULL, run_thread, &args[thread]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
-				}
+				threadpool_start(&jobs[thread], run_thread, &args[thread]);
 			}
 
 			for (size_t thread = 0; thread < threads; thread++) {
-				void *retval;
-
-				if (pthread_join(pthreads[thread], &retval) != 0) {
-					perror("pthread_join");
-				}
+				void *retval = threadpool_join(&jobs[thread]);
 
 				if (retval != NULL) {
 					err = *((int *) retval);
@@ -2394,9 +3371,18 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 					maxzoom++;
 				}
 			}
+
+			pthread_mutex_destroy(&sched.lock);
 		}
 
 		for (size_t j = 0; j < TEMP_FILES; j++) {
+			if (geom_map[j] != NULL) {
+				if (munmap(geom_map[j], geom_size[j]) != 0) {
+					perror("munmap geom");
+					exit(EXIT_FAILURE);
+				}
+			}
+
 			// Can be < 0 if there is only one source file, at z0
 			if (geomfd[j] >= 0) {
 				if (close(geomfd[j]) != 0) {
@@ -2419,7 +3405,11 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			geom_size[j] = geomst.st_size;
 		}
 
+		geom_tiles.swap(sub_tiles);
+
 		if (err != INT_MAX) {
+			tile_writer_finish();
+			report_retries();
 			return err;
 		}
 	}
@@ -2437,5 +3427,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 	if (!quiet) {
 		fprintf(stderr, "\n");
 	}
+	tile_writer_finish();
+	report_retries();
 	return maxzoom;
 }
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include "tilewriter.hpp"
+#include "threadpool.hpp"
+#include "mbtiles.hpp"
+#include "dirtiles.hpp"
+#include "mvt.hpp"
+
+struct queued_tile {
+	int z;
+	unsigned x;
+	unsigned y;
+	std::string data;
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_space = PTHREAD_COND_INITIALIZER;    // a tile has left the queue
+static pthread_cond_t writer_compress = PTHREAD_COND_INITIALIZER;  // a tile needs compressing
+static pthread_cond_t writer_ready = PTHREAD_COND_INITIALIZER;     // a tile is ready to write
+
+static std::deque<queued_tile> to_compress;
+static std::deque<queued_tile> to_write;
+static size_t compressing = 0;
+static size_t queue_capacity;
+static bool finishing = false;
+
+static sqlite3 *writer_outdb;
+static const char *writer_outdir;
+
+static job writer_job;
+static std::vector<job> compressor_jobs;
+
+static void lock() {
+	if (pthread_mutex_lock(&writer_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock() {
+	if (pthread_mutex_unlock(&writer_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void *run_compressor(void *) {
+	lock();
+
+	while (true) {
+		while (to_compress.size() == 0 && !finishing) {
+			pthread_cond_wait(&writer_compress, &writer_lock);
+		}
+		if (to_compress.size() == 0) {
+			break;
+		}
+
+		queued_tile t = std::move(to_compress.front());
+		to_compress.pop_front();
+		compressing++;
+		unlock();
+
+		std::string compressed;
+		compress(t.data, compressed);
+		t.data.swap(compressed);
+
+		lock();
+		compressing--;
+		to_write.push_back(std::move(t));
+		pthread_cond_signal(&writer_ready);
+	}
+
+	// The writer may be waiting for the last compression to finish
+	pthread_cond_broadcast(&writer_ready);
+	unlock();
+	return NULL;
+}
+
+static void *run_writer(void *) {
+	lock();
+
+	while (true) {
+		while (to_write.size() == 0 && !(finishing && to_compress.size() == 0 && compressing == 0)) {
+			pthread_cond_wait(&writer_ready, &writer_lock);
+		}
+		if (to_write.size() == 0) {
+			break;
+		}
+
+		queued_tile t = std::move(to_write.front());
+		to_write.pop_front();
+		pthread_cond_broadcast(&writer_space);
+		unlock();
+
+		if (writer_outdb != NULL) {
+			mbtiles_write_tile(writer_outdb, t.z, t.x, t.y, t.data.data(), t.data.size());
+		} else if (writer_outdir != NULL) {
+			dir_write_tile(writer_outdir, t.z, t.x, t.y, t.data);
+		}
+
+		lock();
+	}
+
+	unlock();
+	return NULL;
+}
+
+void tile_writer_start(sqlite3 *outdb, const char *outdir, size_t compressors, size_t capacity) {
+	writer_outdb = outdb;
+	writer_outdir = outdir;
+	queue_capacity = capacity;
+	finishing = false;
+
+	compressor_jobs.resize(compressors);
+	for (size_t i = 0; i < compressors; i++) {
+		threadpool_start(&compressor_jobs[i], run_compressor, NULL);
+	}
+	threadpool_start(&writer_job, run_writer, NULL);
+}
+
+void tile_writer_put(int z, unsigned x, unsigned y, std::string &data, bool needs_compression) {
+	queued_tile t;
+	t.z = z;
+	t.x = x;
+	t.y = y;
+	t.data.swap(data);
+
+	lock();
+
+	while (to_compress.size() + compressing + to_write.size() >= queue_capacity) {
+		pthread_cond_wait(&writer_space, &writer_lock);
+	}
+
+	if (needs_compression && compressor_jobs.size() > 0) {
+		to_compress.push_back(std::move(t));
+		pthread_cond_signal(&writer_compress);
+	} else {
+		to_write.push_back(std::move(t));
+		pthread_cond_signal(&writer_ready);
+	}
+
+	unlock();
+}
+
+void tile_writer_finish() {
+	lock();
+	finishing = true;
+	pthread_cond_broadcast(&writer_compress);
+	pthread_cond_broadcast(&writer_ready);
+	unlock();
+
+	for (size_t i = 0; i < compressor_jobs.size(); i++) {
+		threadpool_join(&compressor_jobs[i]);
+	}
+	threadpool_join(&writer_job);
+
+	compressor_jobs.clear();
+}
@@ -0,0 +1,20 @@
+#ifndef TILEWRITER_HPP
+#define TILEWRITER_HPP
+
+#include <sqlite3.h>
+#include <string>
+
+// Finished tiles go through a bounded queue to a single thread that owns the
+// output, so that tiling threads don't wait for each other to write. Tiles
+// that haven't been compressed yet are compressed on the way by a separate
+// set of threads.
+
+void tile_writer_start(sqlite3 *outdb, const char *outdir, size_t compressors, size_t capacity);
+
+// Takes the contents of data. Blocks while the queue is full.
+void tile_writer_put(int z, unsigned x, unsigned y, std::string &data, bool needs_compression);
+
+// Waits for all the queued tiles to be written
+void tile_writer_finish();
+
+#endif
@@ -1,6 +1,12 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
 #include "text.hpp"
+#include "mvt.hpp"
+#include "write_json.hpp"
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +24,69 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+static std::string printf_f(double v) {
+	char buf[400];
+	snprintf(buf, sizeof(buf), "%f", v);
+	return buf;
+}
+
+static std::string fast_f(double v) {
+	std::string out;
+	format_f(out, v);
+	return out;
+}
+
+TEST_CASE("Integer formatting", "[format]") {
+	std::vector<unsigned long long> values = {0, 1, 9, 10, 99, 100, 4294967295ULL, 4294967296ULL, 9007199254740993ULL, 18446744073709551615ULL};
+	for (unsigned long long p = 1; p < 10000000000000000000ULL; p *= 10) {
+		values.push_back(p - 1);
+		values.push_back(p);
+	}
+
+	for (size_t i = 0; i < values.size(); i++) {
+		char buf[30];
+		snprintf(buf, sizeof(buf), "%llu", values[i]);
+		std::string out;
+		format_ull(out, values[i]);
+		REQUIRE(out == std::string(buf));
+	}
+}
+
+TEST_CASE("Coordinate formatting", "[format]") {
+	// Odd multiples of 1/128 end in 5 at the seventh decimal place, so they are exact ties
+	for (long long k = -200001; k <= 200001; k += 2) {
+		REQUIRE(fast_f(k / 128.0) == printf_f(k / 128.0));
+		REQUIRE(fast_f(k / 128.0 + 1024) == printf_f(k / 128.0 + 1024));
+	}
+	REQUIRE(fast_f(1 / 128.0) == std::string("0.007812"));
+	REQUIRE(fast_f(3 / 128.0) == std::string("0.023438"));
+
+	// Negative values that round to zero keep their sign
+	double negative_zeroes[] = {-0.0, -1e-300, -1e-7, -4.9e-7, -5e-7, -0.0000004999999999};
+	for (size_t i = 0; i < sizeof(negative_zeroes) / sizeof(negative_zeroes[0]); i++) {
+		REQUIRE(fast_f(negative_zeroes[i]) == printf_f(negative_zeroes[i]));
+		REQUIRE(fast_f(negative_zeroes[i]) == std::string("-0.000000"));
+	}
+	REQUIRE(fast_f(-5.0000001e-7) == std::string("-0.000001"));
+
+	// Subnormals
+	double subnormals[] = {4.9e-324, -4.9e-324, 2.2250738585072009e-308, -1e-310, 1e-320};
+	for (size_t i = 0; i < sizeof(subnormals) / sizeof(subnormals[0]); i++) {
+		REQUIRE(fast_f(subnormals[i]) == printf_f(subnormals[i]));
+	}
+
+	// Around the 1e12 cutoff for falling back to snprintf
+	double large[] = {999999999999.9999, -999999999999.9999, 999999999999.9995, 1e12, -1e12, 1e12 + 0.5, 4503599627370495.5, 9007199254740993.0, 1e300, -1.7976931348623157e308, INFINITY, -INFINITY, NAN};
+	for (size_t i = 0; i < sizeof(large) / sizeof(large[0]); i++) {
+		REQUIRE(fast_f(large[i]) == printf_f(large[i]));
+	}
+
+	// Pseudorandom coordinates across several scales
+	unsigned long long seed = 1;
+	for (size_t i = 0; i < 200000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		double v = ((long long) (seed >> 11) - (1LL << 52)) / (double) (1LL << (i % 60));
+		REQUIRE(fast_f(v) == printf_f(v));
+	}
+}
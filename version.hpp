@@ -1,6 +1,6 @@
 #ifndef VERSION_HPP
 #define VERSION_HPP
 
-#define VERSION "tippecanoe v1.22.0\n"
+#define VERSION "tippecanoe v1.34.3\n"
 
 #endif
@@ -3,6 +3,8 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <atomic>
+#include <cmath>
 #include "projection.hpp"
 #include "geometry.hpp"
 #include "mvt.hpp"
@@ -24,75 +26,167 @@ struct lonlat {
 	}
 };
 
-void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain) {
+// Appends v the same way printf("%llu") would
+void format_ull(std::string &out, unsigned long long v) {
+	char buf[20];
+	size_t n = sizeof(buf);
+
+	do {
+		buf[--n] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+
+	out.append(buf + n, sizeof(buf) - n);
+}
+
+// Appends v the same way printf("%lld") would
+static void format_ll(std::string &out, long long v) {
+	if (v < 0) {
+		out.push_back('-');
+		format_ull(out, 0ULL - (unsigned long long) v);
+	} else {
+		format_ull(out, v);
+	}
+}
+
+// Appends v the same way printf("%f") would: the exact binary value,
+// rounded half-even to six decimal places, with the sign of negative zero
+void format_f(std::string &out, double v) {
+	if (!std::isfinite(v) || fabs(v) >= 1e12) {
+		char buf[400];
+		snprintf(buf, sizeof(buf), "%f", v);
+		out.append(buf);
+		return;
+	}
+
+	// fabs(v) == mantissa * 2^-shift exactly, and shift > 0 because fabs(v) < 2^53
+	int exp;
+	double frac = frexp(fabs(v), &exp);
+	unsigned long long mantissa = (unsigned long long) ldexp(frac, 53);
+	int shift = 53 - exp;
+
+	// Multiplied out, mantissa * 10^6 is less than 2^73
+	unsigned __int128 scaled = (unsigned __int128) mantissa * 1000000;
+	unsigned long long q = 0;
+	if (shift < 100) {
+		unsigned __int128 half = (unsigned __int128) 1 << (shift - 1);
+		unsigned __int128 rem = scaled & ((half << 1) - 1);
+		q = scaled >> shift;
+
+		if (rem > half || (rem == half && (q & 1) != 0)) {
+			q++;
+		}
+	}
+
+	if (std::signbit(v)) {
+		out.push_back('-');
+	}
+	format_ull(out, q / 1000000);
+
+	char buf[7];
+	unsigned long long decimals = q % 1000000;
+	buf[0] = '.';
+	for (int i = 6; i > 0; i--) {
+		buf[i] = '0' + decimals % 10;
+		decimals /= 10;
+	}
+	out.append(buf, sizeof(buf));
+}
+
+static void format_coordinate(std::string &out, lonlat const &ll) {
+	out.append("[ ");
+	format_f(out, ll.lon);
+	out.append(", ");
+	format_f(out, ll.lat);
+	out.append(" ]");
+}
+
+static void format_number(std::string &out, double v) {
+	if (v == (long long) v) {
+		format_ll(out, (long long) v);
+	} else {
+		char buf[50];
+		snprintf(buf, sizeof(buf), "%g", v);
+		out.append(buf);
+	}
+}
+
+// Formats the features into out, writing out to fp whenever it gets large if fp isn't NULL
+static void layer_to_geojson(std::string &out, FILE *fp, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain) {
 	for (size_t f = 0; f < layer.features.size(); f++) {
 		mvt_feature const &feat = layer.features[f];
 
 		if (comma && f != 0) {
-			fprintf(fp, ",\n");
+			out.append(",\n");
 		}
 
-		fprintf(fp, "{ \"type\": \"Feature\"");
+		out.append("{ \"type\": \"Feature\"");
 
 		if (feat.has_id) {
-			fprintf(fp, ", \"id\": %llu", feat.id);
+			out.append(", \"id\": ");
+			format_ull(out, feat.id);
 		}
 
 		if (name || zoom || index != 0 || sequence != 0 || extent != 0) {
 			bool need_comma = false;
 
-			fprintf(fp, ", \"tippecanoe\": { ");
+			out.append(", \"tippecanoe\": { ");
 
 			if (name) {
 				if (need_comma) {
-					fprintf(fp, ", ");
+					out.append(", ");
 				}
-				fprintf(fp, "\"layer\": ");
-				fprintq(fp, layer.name.c_str());
+				out.append("\"layer\": ");
+				sprintq(out, layer.name.c_str());
 				need_comma = true;
 			}
 
 			if (zoom) {
 				if (need_comma) {
-					fprintf(fp, ", ");
+					out.append(", ");
 				}
-				fprintf(fp, "\"minzoom\": %u, ", z);
-				fprintf(fp, "\"maxzoom\": %u", z);
+				out.append("\"minzoom\": ");
+				format_ull(out, z);
+				out.append(", \"maxzoom\": ");
+				format_ull(out, z);
 				need_comma = true;
 			}
 
 			if (index != 0) {
 				if (need_comma) {
-					fprintf(fp, ", ");
+					out.append(", ");
 				}
-				fprintf(fp, "\"index\": %llu", index);
+				out.append("\"index\": ");
+				format_ull(out, index);
 				need_comma = true;
 			}
 
 			if (sequence != 0) {
 				if (need_comma) {
-					fprintf(fp, ", ");
+					out.append(", ");
 				}
-				fprintf(fp, "\"sequence\": %lld", sequence);
+				out.append("\"sequence\": ");
+				format_ll(out, sequence);
 				need_comma = true;
 			}
 
 			if (extent != 0) {
 				if (need_comma) {
-					fprintf(fp, ", ");
+					out.append(", ");
 				}
-				fprintf(fp, "\"extent\": %lld", extent);
+				out.append("\"extent\": ");
+				format_ll(out, extent);
 				need_comma = true;
 			}
 
-			fprintf(fp, " }");
+			out.append(" }");
 		}
 
-		fprintf(fp, ", \"properties\": { ");
+		out.append(", \"properties\": { ");
 
 		for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
 			if (t != 0) {
-				fprintf(fp, ", ");
+				out.append(", ");
 			}
 
 			if (feat.tags[t] >= layer.keys.size()) {
@@ -107,42 +201,27 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 			const char *key = layer.keys[feat.tags[t]].c_str();
 			mvt_value const &val = layer.values[feat.tags[t + 1]];
 
+			sprintq(out, key);
+			out.append(": ");
+
 			if (val.type == mvt_string) {
-				fprintq(fp, key);
-				fprintf(fp, ": ");
-				fprintq(fp, val.string_value.c_str());
+				sprintq(out, val.string_value.c_str());
 			} else if (val.type == mvt_int) {
-				fprintq(fp, key);
-				fprintf(fp, ": %lld", (long long) val.numeric_value.int_value);
+				format_ll(out, (long long) val.numeric_value.int_value);
 			} else if (val.type == mvt_double) {
-				fprintq(fp, key);
-				double v = val.numeric_value.double_value;
-				if (v == (long long) v) {
-					fprintf(fp, ": %lld", (long long) v);
-				} else {
-					fprintf(fp, ": %g", v);
-				}
+				format_number(out, val.numeric_value.double_value);
 			} else if (val.type == mvt_float) {
-				fprintq(fp, key);
-				double v = val.numeric_value.float_value;
-				if (v == (long long) v) {
-					fprintf(fp, ": %lld", (long long) v);
-				} else {
-					fprintf(fp, ": %g", v);
-				}
+				format_number(out, val.numeric_value.float_value);
 			} else if (val.type == mvt_sint) {
-				fprintq(fp, key);
-				fprintf(fp, ": %lld", (long long) val.numeric_value.sint_value);
+				format_ll(out, (long long) val.numeric_value.sint_value);
 			} else if (val.type == mvt_uint) {
-				fprintq(fp, key);
-				fprintf(fp, ": %lld", (long long) val.numeric_value.uint_value);
+				format_ll(out, (long long) val.numeric_value.uint_value);
 			} else if (val.type == mvt_bool) {
-				fprintq(fp, key);
-				fprintf(fp, ": %s", val.numeric_value.bool_value ? "true" : "false");
+				out.append(val.numeric_value.bool_value ? "true" : "false");
 			}
 		}
 
-		fprintf(fp, " }, \"geometry\": { ");
+		out.append(" }, \"geometry\": { ");
 
 		std::vector<lonlat> ops;
 
@@ -167,16 +246,17 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 
 		if (feat.type == VT_POINT) {
 			if (ops.size() == 1) {
-				fprintf(fp, "\"type\": \"Point\", \"coordinates\": [ %f, %f ]", ops[0].lon, ops[0].lat);
+				out.append("\"type\": \"Point\", \"coordinates\": ");
+				format_coordinate(out, ops[0]);
 			} else {
-				fprintf(fp, "\"type\": \"MultiPoint\", \"coordinates\": [ ");
+				out.append("\"type\": \"MultiPoint\", \"coordinates\": [ ");
 				for (size_t i = 0; i < ops.size(); i++) {
 					if (i != 0) {
-						fprintf(fp, ", ");
+						out.append(", ");
 					}
-					fprintf(fp, "[ %f, %f ]", ops[i].lon, ops[i].lat);
+					format_coordinate(out, ops[i]);
 				}
-				fprintf(fp, " ]");
+				out.append(" ]");
 			}
 		} else if (feat.type == VT_LINE) {
 			int movetos = 0;
@@ -187,32 +267,33 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 			}
 
 			if (movetos < 2) {
-				fprintf(fp, "\"type\": \"LineString\", \"coordinates\": [ ");
+				out.append("\"type\": \"LineString\", \"coordinates\": [ ");
 				for (size_t i = 0; i < ops.size(); i++) {
 					if (i != 0) {
-						fprintf(fp, ", ");
+						out.append(", ");
 					}
-					fprintf(fp, "[ %f, %f ]", ops[i].lon, ops[i].lat);
+					format_coordinate(out, ops[i]);
 				}
-				fprintf(fp, " ]");
+				out.append(" ]");
 			} else {
-				fprintf(fp, "\"type\": \"MultiLineString\", \"coordinates\": [ [ ");
+				out.append("\"type\": \"MultiLineString\", \"coordinates\": [ [ ");
 				int state = 0;
 				for (size_t i = 0; i < ops.size(); i++) {
 					if (ops[i].op == VT_MOVETO) {
 						if (state == 0) {
-							fprintf(fp, "[ %f, %f ]", ops[i].lon, ops[i].lat);
+							format_coordinate(out, ops[i]);
 							state = 1;
 						} else {
-							fprintf(fp, " ], [ ");
-							fprintf(fp, "[ %f, %f ]", ops[i].lon, ops[i].lat);
+							out.append(" ], [ ");
+							format_coordinate(out, ops[i]);
 							state = 1;
 						}
 					} else {
-						fprintf(fp, ", [ %f, %f ]", ops[i].lon, ops[i].lat);
+						out.append(", ");
+						format_coordinate(out, ops[i]);
 					}
 				}
-				fprintf(fp, " ] ]");
+				out.append(" ] ]");
 			}
 		} else if (feat.type == VT_POLYGON) {
 			std::vector<std::vector<lonlat> > rings;
@@ -235,15 +316,13 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 
 				if (i + 1 >= ops.size() || ops[i + 1].op == VT_MOVETO) {
 					if (ops[i].op != VT_CLOSEPATH) {
-						static bool warned = false;
+						static std::atomic<bool> warned(false);
 
-						if (!warned) {
+						if (!warned.exchange(true)) {
 							fprintf(stderr, "Ring does not end with closepath (ends with %d)\n", ops[i].op);
 							if (complain) {
 								exit(EXIT_FAILURE);
 							}
-
-							warned = true;
 						}
 					}
 				}
@@ -270,52 +349,50 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 			}
 
 			if (outer > 1) {
-				fprintf(fp, "\"type\": \"MultiPolygon\", \"coordinates\": [ [ [ ");
+				out.append("\"type\": \"MultiPolygon\", \"coordinates\": [ [ [ ");
 			} else {
-				fprintf(fp, "\"type\": \"Polygon\", \"coordinates\": [ [ ");
+				out.append("\"type\": \"Polygon\", \"coordinates\": [ [ ");
 			}
 
 			int state = 0;
 			for (size_t i = 0; i < rings.size(); i++) {
 				if (i == 0 && areas[i] < 0) {
-					static bool warned = false;
+					static std::atomic<bool> warned(false);
 
-					if (!warned) {
+					if (!warned.exchange(true)) {
 						fprintf(stderr, "Polygon begins with an inner ring\n");
 						if (complain) {
 							exit(EXIT_FAILURE);
 						}
-
-						warned = true;
 					}
 				}
 
 				if (areas[i] >= 0) {
 					if (state != 0) {
 						// new multipolygon
-						fprintf(fp, " ] ], [ [ ");
+						out.append(" ] ], [ [ ");
 					}
 					state = 1;
 				}
 
 				if (state == 2) {
 					// new ring in the same polygon
-					fprintf(fp, " ], [ ");
+					out.append(" ], [ ");
 				}
 
 				for (size_t j = 0; j < rings[i].size(); j++) {
 					if (rings[i][j].op != VT_CLOSEPATH) {
 						if (j != 0) {
-							fprintf(fp, ", ");
+							out.append(", ");
 						}
 
-						fprintf(fp, "[ %f, %f ]", rings[i][j].lon, rings[i][j].lat);
+						format_coordinate(out, rings[i][j]);
 					} else {
 						if (j != 0) {
-							fprintf(fp, ", ");
+							out.append(", ");
 						}
 
-						fprintf(fp, "[ %f, %f ]", rings[i][0].lon, rings[i][0].lat);
+						format_coordinate(out, rings[i][0]);
 					}
 				}
 
@@ -323,14 +400,48 @@ void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x,
 			}
 
 			if (outer > 1) {
-				fprintf(fp, " ] ] ]");
+				out.append(" ] ] ]");
 			} else {
-				fprintf(fp, " ] ]");
+				out.append(" ] ]");
 			}
 		}
 
-		fprintf(fp, " } }\n");
+		out.append(" } }\n");
+
+		if (fp != NULL && out.size() >= 64 * 1024) {
+			fwrite(out.data(), 1, out.size(), fp);
+			out.clear();
+		}
+	}
+}
+
+void layer_to_geojson(std::string &out, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain) {
+	layer_to_geojson(out, NULL, layer, z, x, y, comma, name, zoom, index, sequence, extent, complain);
+}
+
+void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain) {
+	std::string out;
+	layer_to_geojson(out, fp, layer, z, x, y, comma, name, zoom, index, sequence, extent, complain);
+	fwrite(out.data(), 1, out.size(), fp);
+}
+
+void sprintq(std::string &out, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+
+	out.push_back('"');
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"') {
+			out.push_back('\\');
+			out.push_back(*s);
+		} else if (*s >= 0 && *s < ' ') {
+			out.append("\\u00");
+			out.push_back(hex[*s >> 4]);
+			out.push_back(hex[*s & 0xF]);
+		} else {
+			out.push_back(*s);
+		}
 	}
+	out.push_back('"');
 }
 
 void fprintq(FILE *fp, const char *s) {
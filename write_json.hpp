@@ -1,2 +1,6 @@
 void layer_to_geojson(FILE *fp, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain);
+void layer_to_geojson(std::string &out, mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, unsigned long long index, long long sequence, long long extent, bool complain);
 void fprintq(FILE *f, const char *s);
+void sprintq(std::string &out, const char *s);
+void format_ull(std::string &out, unsigned long long v);
+void format_f(std::string &out, double v);